@@ -12,15 +12,46 @@
  * cache_release: O(K)                 *
  * cache_alloc: O(1*)                  *
  * cache_free: O(1)                    *
+ * cache_alloc_bulk: O(N)              *
+ * cache_free_bulk: O(N*log(N))        *
  * cache_shrink: O(K)                  *
+ * slab_malloc: O(1*)                  *
+ * slab_free: O(1)                     *
+ * slab_kfree: O(1)                    *
  *                                     *
  * K - count of slabs                  *
  ***************************************/
 
 
+#include <algorithm>
 #include <iostream>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <new>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 #include <pthread.h>
 #include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/sysinfo.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#define SLAB_HAVE_RSEQ 1
+#include <sys/rseq.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#endif
+
+#ifdef __SANITIZE_THREAD__
+extern "C" void __tsan_acquire(void *addr);
+extern "C" void __tsan_release(void *addr);
+#endif
 
 using namespace std;
 
@@ -31,32 +62,213 @@ using namespace std;
  *                     *
  ***********************/
 
+// Link of free list. It lives inside storage of free object,
+// so allocated objects have no header
 struct data_block {
     data_block * next = nullptr;
 };
 static const int DATA_BLOCK_SIZE = sizeof(data_block);
 
+// Sizes of objects are rounded up to it. Slab is aligned on its
+// size and objects lie in a row from its start, so every object is
+// aligned on the largest power of 2, that divides object_size
+static const size_t OBJECT_ALIGN = 8;
+
 struct meta_block {
     meta_block * next = nullptr;
+    meta_block * prev = nullptr;
     data_block * head = nullptr;
+    // never allocated objects lie in [unused, slab + cnt_objects * object_size)
+    uint8_t *    unused = nullptr;
     size_t cnt_objects= 0;
+    // back-pointer for slab_kfree
+    struct cache * owner = nullptr;
+    // CACHE_LOCKFREE_FREE: objects pushed by CAS without lock,
+    // word is [tag:31][pending:1][offset of link + 1:32]
+    uint64_t     free_tagged = 0;
+    meta_block * pending_next = nullptr;
+    // CACHE_THREAD_HEAPS: heap, that owns slab, nullptr - it is in
+    // lists of cache. Changed under both locks, heap's and cache's
+    struct thread_heap * heap = nullptr;
+    // bin of partially busy slab, see CNT_PARTBUSY_BINS
+    int          bin = 0;
 };
 static const int META_BLOCK_SIZE = sizeof(meta_block);
 
 static const size_t PAGE_SIZE = 4 * (1 << 10); // 4 KiB
 static const int PAGE_SIZE_DEGREE_2 = 12;
 
+// Geometry of slab. It depends on object size and order only,
+// so it is shared by cache_setup and slab_cache<T> (compile-time)
+static constexpr size_t slab_size_of(int slab_order) {
+    return PAGE_SIZE << slab_order;
+}
+static constexpr size_t object_round_up(size_t object_size) {
+    return (object_size + OBJECT_ALIGN - 1) & ~(OBJECT_ALIGN - 1);
+}
+// constructed - cache has ctor/dtor, then link of free list lies after object
+static constexpr size_t cache_link_offset_of(size_t object_size, bool constructed) {
+    return constructed ? object_round_up(object_size) : 0;
+}
+static constexpr size_t cache_object_size_of(size_t object_size, bool constructed) {
+    return constructed ? object_round_up(object_size) + DATA_BLOCK_SIZE
+                       : object_round_up(object_size < DATA_BLOCK_SIZE ? DATA_BLOCK_SIZE : object_size);
+}
+// meta_block is at the end of slab, so slab_kfree finds it without knowing the cache
+static constexpr size_t cache_meta_block_offset_of(int slab_order) {
+    return slab_size_of(slab_order) - META_BLOCK_SIZE;
+}
+static constexpr size_t cache_cnt_objects_of(size_t object_size, int slab_order) {
+    return cache_meta_block_offset_of(slab_order) / object_size;
+}
+
+// Objects bigger than it do not lie in slabs: every object takes own
+// pages of buddy allocator, so no slab tail is wasted. A few freed
+// objects are kept by cache for reuse
+static const size_t CACHE_LARGE_SIZE = 128 * (1 << 10); // 128 KiB
+static const int LARGE_STASH_MAX = 4;
+
+// Magazine is a stack of free objects (rounds),
+// which a thread allocates and frees without lock
+static const int MAGAZINE_MAX_ROUNDS = 64;
+
+struct magazine {
+    magazine * next = nullptr;
+    size_t cnt_rounds = 0;
+    void * rounds[MAGAZINE_MAX_ROUNDS];
+};
+
+// Depot keeps at most so many full (and empty) magazines,
+// the rest is returned into slabs (or magazine_cache)
+static const size_t DEPOT_MAX_MAGAZINES = 16;
+
+// Per-CPU stack of free objects. It is changed only inside
+// rseq critical sections of its CPU, or by drain while locked
+static const int PERCPU_MAX_OBJECTS = 64;
+static const int PERCPU_BATCH = 32;
+
+struct alignas(64) percpu_slot {
+    uint64_t cnt_objects;
+    uint64_t locked;
+    void * objects[PERCPU_MAX_OBJECTS];
+};
+
+// Partially busy slabs are binned by count of free objects, bin 0
+// keeps the fullest ones. Allocation takes the fullest slab, so
+// nearly empty slabs drain and come to free list for cache_shrink
+static const int CNT_PARTBUSY_BINS = 4;
+
+// Flags of cache_setup
+static const int CACHE_NO_MAGAZINES = 1 << 0;
+static const int CACHE_PERCPU       = 1 << 1;
+static const int CACHE_LOCKFREE_FREE = 1 << 2;
+static const int CACHE_THREAD_HEAPS  = 1 << 3;
+
+// Fields of meta_block->free_tagged
+static const uint64_t LOCKFREE_OFFSET_MASK = ((uint64_t)1 << 32) - 1;
+static const uint64_t LOCKFREE_PENDING     = (uint64_t)1 << 32;
+static const uint64_t LOCKFREE_TAG         = (uint64_t)1 << 33;
+
 struct cache {
-    size_t  object_size;
-    int     slab_order;
-    size_t  cnt_objects;
-    size_t  meta_block_offset;
+    // all fields have constant initializers, so static caches are ready
+    // before any dynamic initialization (operator new may be called by it)
+    mutable pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+
+    size_t  object_size         = 0;
+    int     slab_order          = 0;
+    size_t  cnt_objects         = 0;
+    size_t  meta_block_offset   = 0;
 
     meta_block * free_list_slabs       = nullptr;
     meta_block * busy_list_slabs       = nullptr;
-    meta_block * partbusy_list_slabs   = nullptr;
+    meta_block * partbusy_list_slabs[CNT_PARTBUSY_BINS] = {};
+
+    // Magazine layer, magazine_size == 0 - it's off.
+    // Depot lists are guarded by mtx
+    uint64_t     id                    = 0;
+    int          tls_slot              = 0;
+    size_t       magazine_size         = 0;
+    magazine *   depot_full_magazines  = nullptr;
+    magazine *   depot_empty_magazines = nullptr;
+    size_t       depot_cnt_full        = 0;
+    size_t       depot_cnt_empty       = 0;
+    cache *      registry_next         = nullptr;
+
+    // Per-CPU layer, percpu_slots == nullptr - it's off
+    percpu_slot * percpu_slots         = nullptr;
+    int           percpu_order         = 0;
+
+    // Object caching: objects are constructed once, when they
+    // are carved from slab, and destroyed, when slab is released.
+    // Free list link lies at link_offset, after constructed fields
+    void       (* ctor)(void *)        = nullptr;
+    void       (* dtor)(void *)        = nullptr;
+    size_t        link_offset          = 0;
+
+    // Objects, which were freed while mtx was busy: they are pushed
+    // by one CAS and come back into slabs by the next locked alloc
+    data_block *  remote_free          = nullptr;
+
+    // CACHE_LOCKFREE_FREE: slabs, which got objects by CAS since
+    // the last locked alloc (pending bit of their word is set)
+    bool          lockfree_free        = false;
+    meta_block *  pending_slabs        = nullptr;
+
+    // CACHE_THREAD_HEAPS: all heaps of cache, attached to threads
+    // or not. They live till cache_release, list is guarded by mtx
+    bool          thread_heaps         = false;
+    struct thread_heap * heaps         = nullptr;
+
+    // Large objects, large_order < 0 - it's off. Stash of freed
+    // objects (constructed, if ctor) is guarded by mtx
+    int           large_order          = -1;
+    size_t        cnt_large_stash      = 0;
+    void *        large_stash[LARGE_STASH_MAX] = {};
+};
+
+// Magazines of one thread for one cache. Bonwick's
+// 'loaded' and 'previous' magazines
+struct thread_magazines {
+    uint64_t     cache_id;
+    cache *      owner;
+    magazine *   loaded;
+    magazine *   previous;
+};
+
+// Every registered cache has own slot (tls_slot) while there are at
+// most THREAD_MAGAZINE_SLOTS of them: size classes of kmalloc and node
+// caches take ~110, so they never evict each other
+static const int THREAD_MAGAZINE_SLOTS = 256;
+static thread_local thread_magazines tls_magazines[THREAD_MAGAZINE_SLOTS];
+static thread_local bool tls_magazines_registered = false;
+
+// Hoard's per-thread heap of one cache: it owns slabs, so its thread
+// allocates without contention, and other threads free into them
+// under its lock. When it becomes too empty (less than 3/4 of objects
+// are used and more than HEAP_EMPTY_SLABS slabs are free), its slabs
+// migrate back into lists of cache
+static const size_t HEAP_EMPTY_SLABS = 2;
+static const size_t HEAP_EMPTY_FRACTION = 4; // 1/4
+
+struct alignas(64) thread_heap {
+    pthread_mutex_t mtx;
+    thread_heap *   next;
+    bool            attached;
+    meta_block *    partial_slabs;
+    meta_block *    busy_slabs;
+    size_t          cnt_used;
+    size_t          cnt_capacity;
+};
+
+struct thread_heap_slot {
+    uint64_t      cache_id;
+    cache *       owner;
+    thread_heap * heap;
 };
 
+static thread_local thread_heap_slot tls_heaps[THREAD_MAGAZINE_SLOTS];
+static thread_local bool tls_heaps_registered = false;
+
 enum class SlabType {
     FREE = 1,
     BUSY,
@@ -65,11 +277,45 @@ enum class SlabType {
 
 struct map_item {
     void * aligment_ptr  = nullptr;
-    void * allocated_ptr = nullptr;
+    int    order         = 0;
+};
+
+// Open addressing hash table (linear probing) of slabs,
+// keyed by aligment_ptr. It grows twice, when it's half full
+static const size_t MAP_MIN_CAPACITY = 1024;
+static map_item * map_items = nullptr;
+static size_t map_capacity = 0;
+static size_t map_size = 0;
+
+// Binary buddy allocator of orders [0, BUDDY_MAX_ORDER] over
+// arenas of reserved memory, each arena is one block of max order
+static const int BUDDY_MAX_ORDER = 18;
+static const size_t BUDDY_ARENA_SIZE = PAGE_SIZE << BUDDY_MAX_ORDER; // 1 GiB
+static const size_t BUDDY_ARENA_PAGES = (size_t)1 << BUDDY_MAX_ORDER;
+
+// Node of free list, it lives in the first bytes of free block
+struct buddy_block {
+    buddy_block * next = nullptr;
+    buddy_block * prev = nullptr;
+};
+
+struct buddy_arena {
+    uint8_t *     base = nullptr;
+    buddy_arena * next = nullptr;
+    // order + 1 for the first page of free block, otherwise 0
+    uint8_t       free_order[BUDDY_ARENA_PAGES];
+    // order + 1 (| BUDDY_SLAB) for the first page of allocated
+    // block, otherwise 0. It's read without PAGE_MTX by slab_kfree
+    uint8_t       alloc_order[BUDDY_ARENA_PAGES];
+    // owner cache for the first page of block of large object,
+    // otherwise nullptr. It's read without PAGE_MTX by slab_kfree
+    struct cache * alloc_owner[BUDDY_ARENA_PAGES];
 };
 
-static const int max_map_items = (1 << 15);
-static map_item map_item_array[max_map_items];
+static const uint8_t BUDDY_SLAB = 0x80;
+
+static buddy_arena * buddy_arenas = nullptr;
+static buddy_block * buddy_free_lists[BUDDY_MAX_ORDER + 1];
 
 struct pthread_lock_quard {
     pthread_lock_quard(pthread_mutex_t& mtx) : mtx_(mtx) {
@@ -87,38 +333,352 @@ private:
 	bool isUnlocked_ = false;
 };
 
-static pthread_mutex_t MTX = PTHREAD_MUTEX_INITIALIZER;
+// Guards only the page layer (alloc_slab/free_slab, buddy and map_items).
+// Every struct cache has its own mutex, so independent caches never
+// contend with each other. Lock order: cache->mtx, then PAGE_MTX.
+static pthread_mutex_t PAGE_MTX = PTHREAD_MUTEX_INITIALIZER;
+
+// List of live caches with magazine layer or thread heaps. A thread
+// checks it before returning its magazines (heap) into a cache, that
+// may be released already.
+// Lock order: REGISTRY_MTX, then thread_heap->mtx, then cache->mtx
+static pthread_mutex_t REGISTRY_MTX = PTHREAD_MUTEX_INITIALIZER;
+static cache * cache_registry = nullptr;
+static uint64_t cache_last_id = 0;
+
+// Magazines itself are allocated from the internal cache
+static struct cache magazine_cache;
+static pthread_once_t magazine_once = PTHREAD_ONCE_INIT;
+static pthread_key_t magazine_key;
+
+// Thread heaps are allocated from the internal cache too
+static struct cache heap_cache;
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+static pthread_key_t heap_key;
+
+/**
+ * It maps anonymous memory of size with natural alignment.
+ * It maps size + alignment - PAGE_SIZE bytes and unmaps
+ * the unaligned head and the tail, so nothing is wasted.
+ *
+ * \param size, alignment - multiples of PAGE_SIZE
+ *
+ * \return pointer to memory or nullptr, if mmap fails
+ **/
+static void * map_aligned(size_t size, size_t alignment) {
+    const size_t map_size = size + alignment - PAGE_SIZE;
+
+    void * map_ptr = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map_ptr == MAP_FAILED)
+        return nullptr;
+
+    size_t map_numptr = (size_t)map_ptr;
+    size_t aligment_numptr = (map_numptr + alignment - 1) & ~(alignment - 1);
+    size_t head = aligment_numptr - map_numptr;
+    size_t tail = map_size - head - size;
+
+    if (head != 0)
+        munmap(map_ptr, head);
+    if (tail != 0)
+        munmap((void *)(aligment_numptr + size), tail);
+
+    return (void *)aligment_numptr;
+}
+/***********************
+ * Buddy allocator     *
+ * (PAGE_MTX must be   *
+ * held)               *
+ ***********************/
+static void buddy_list_push(buddy_arena * arena, buddy_block * block, int order) {
+    block->prev = nullptr;
+    block->next = buddy_free_lists[order];
+    if (block->next != nullptr)
+        block->next->prev = block;
+    buddy_free_lists[order] = block;
+
+    arena->free_order[((uint8_t *)block - arena->base) >> PAGE_SIZE_DEGREE_2] = order + 1;
+}
+static void buddy_list_unlink(buddy_arena * arena, buddy_block * block, int order) {
+    if (block->prev != nullptr)
+        block->prev->next = block->next;
+    else
+        buddy_free_lists[order] = block->next;
+    if (block->next != nullptr)
+        block->next->prev = block->prev;
+
+    arena->free_order[((uint8_t *)block - arena->base) >> PAGE_SIZE_DEGREE_2] = 0;
+}
+// Arenas are only added, so the list is read without PAGE_MTX
+static buddy_arena * buddy_arena_of(void * ptr) {
+    uint8_t * base = (uint8_t *)((size_t)ptr & ~(BUDDY_ARENA_SIZE - 1));
+    buddy_arena * arena = __atomic_load_n(&buddy_arenas, __ATOMIC_ACQUIRE);
+
+    while (arena != nullptr && arena->base != base)
+        arena = arena->next;
+    return arena;
+}
+/**
+ * It reserves one more arena, it becomes a free block of max order
+ **/
+static bool buddy_grow() {
+    void * meta = mmap(NULL, sizeof(buddy_arena), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (meta == MAP_FAILED)
+        return false;
+
+    buddy_arena * arena = (buddy_arena *)meta;
+    arena->base = (uint8_t *)map_aligned(BUDDY_ARENA_SIZE, BUDDY_ARENA_SIZE);
+    if (arena->base == nullptr) {
+        munmap(meta, sizeof(buddy_arena));
+        return false;
+    }
+
+    arena->next = buddy_arenas;
+    __atomic_store_n(&buddy_arenas, arena, __ATOMIC_RELEASE);
+    buddy_list_push(arena, (buddy_block *)arena->base, BUDDY_MAX_ORDER);
+    return true;
+}
+/**
+ * It takes the smallest free block of order >= the order
+ * and splits it in halves down to the order per O(BUDDY_MAX_ORDER)
+ *
+ * \return block of PAGE_SIZE << order bytes, that is aligned
+ * on its size, or nullptr if no memory
+ **/
+static void * buddy_alloc(int order) {
+    int curr_order = order;
+
+    while (curr_order <= BUDDY_MAX_ORDER && buddy_free_lists[curr_order] == nullptr)
+        curr_order++;
+
+    if (curr_order > BUDDY_MAX_ORDER) {
+        if (!buddy_grow())
+            return nullptr;
+        curr_order = BUDDY_MAX_ORDER;
+    }
+
+    buddy_block * block = buddy_free_lists[curr_order];
+    buddy_arena * arena = buddy_arena_of(block);
+    buddy_list_unlink(arena, block, curr_order);
+
+    while (curr_order > order) {
+        curr_order--;
+        buddy_block * half = (buddy_block *)((uint8_t *)block + (PAGE_SIZE << curr_order));
+        buddy_list_push(arena, half, curr_order);
+    }
+
+    arena->alloc_order[((uint8_t *)block - arena->base) >> PAGE_SIZE_DEGREE_2] = order + 1;
+    return block;
+}
+static uint8_t * buddy_alloc_mark(void * block) {
+    buddy_arena * arena = buddy_arena_of(block);
+    return &arena->alloc_order[((uint8_t *)block - arena->base) >> PAGE_SIZE_DEGREE_2];
+}
+static struct cache ** buddy_alloc_owner(void * block) {
+    buddy_arena * arena = buddy_arena_of(block);
+    return &arena->alloc_owner[((uint8_t *)block - arena->base) >> PAGE_SIZE_DEGREE_2];
+}
+/**
+ * It finds allocated block, that contains ptr, per O(BUDDY_MAX_ORDER)
+ * without PAGE_MTX: pages inside of allocated block have no marks,
+ * so the first marked page on the way down is the block head.
+ * ptr must be inside of allocated block
+ *
+ * \return mark of the block (alloc_order) and block into *block
+ **/
+static uint8_t buddy_block_of(void * ptr, void ** block) {
+    buddy_arena * arena = buddy_arena_of(ptr);
+    assert(arena != nullptr);
+
+    size_t page = ((uint8_t *)ptr - arena->base) >> PAGE_SIZE_DEGREE_2;
+
+    for (int order = 0; order <= BUDDY_MAX_ORDER; order++) {
+        size_t head = page & ~(((size_t)1 << order) - 1);
+        uint8_t mark = arena->alloc_order[head];
+
+        if (mark != 0) {
+            *block = arena->base + (head << PAGE_SIZE_DEGREE_2);
+            return mark;
+        }
+    }
+
+    assert(false);
+    return 0;
+}
+/**
+ * It come back block of the order and merges it with
+ * its free buddies per O(BUDDY_MAX_ORDER). The pages
+ * of block except the first one are returned to the kernel
+ **/
+static void buddy_free(void * ptr, int order) {
+    buddy_arena * arena = buddy_arena_of(ptr);
+    assert(arena != nullptr);
+
+    arena->alloc_order[((uint8_t *)ptr - arena->base) >> PAGE_SIZE_DEGREE_2] = 0;
+    arena->alloc_owner[((uint8_t *)ptr - arena->base) >> PAGE_SIZE_DEGREE_2] = nullptr;
+
+    if (order > 0)
+        madvise((uint8_t *)ptr + PAGE_SIZE, (PAGE_SIZE << order) - PAGE_SIZE, MADV_DONTNEED);
+
+    size_t offset = (uint8_t *)ptr - arena->base;
+
+    while (order < BUDDY_MAX_ORDER) {
+        size_t buddy_offset = offset ^ (PAGE_SIZE << order);
+
+        if (arena->free_order[buddy_offset >> PAGE_SIZE_DEGREE_2] != order + 1)
+            break;
+
+        buddy_list_unlink(arena, (buddy_block *)(arena->base + buddy_offset), order);
+        offset &= buddy_offset;
+        order++;
+    }
+
+    buddy_list_push(arena, (buddy_block *)(arena->base + offset), order);
+}
+/**
+ * \return true, if every arena is one free block of max order
+ **/
+[[maybe_unused]] static bool buddy_is_empty() {
+    pthread_lock_quard lock(PAGE_MTX);
+
+    for (buddy_arena * arena = buddy_arenas; arena != nullptr; arena = arena->next)
+        if (arena->free_order[0] != BUDDY_MAX_ORDER + 1)
+            return false;
+    return true;
+}
+
+
+/***********************
+ * Map of slabs        *
+ * (PAGE_MTX must be   *
+ * held)               *
+ ***********************/
+static size_t map_hash(void * ptr) {
+    size_t hash = ((size_t)ptr >> PAGE_SIZE_DEGREE_2) * 0x9E3779B97F4A7C15ull;
+    return hash ^ (hash >> 29);
+}
+static void map_place(map_item * items, size_t capacity, map_item item) {
+    size_t idx = map_hash(item.aligment_ptr) & (capacity - 1);
+
+    while (items[idx].aligment_ptr != nullptr)
+        idx = (idx + 1) & (capacity - 1);
+    items[idx] = item;
+}
+/**
+ * It doubles capacity of map and rehashes all items per O(N)
+ **/
+static bool map_grow() {
+    size_t capacity = map_capacity == 0 ? MAP_MIN_CAPACITY : 2 * map_capacity;
+
+    void * ptr = mmap(NULL, capacity * sizeof(map_item), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+        return false;
+
+    map_item * items = (map_item *)ptr;
+    for (size_t i = 0; i < map_capacity; i++)
+        if (map_items[i].aligment_ptr != nullptr)
+            map_place(items, capacity, map_items[i]);
+
+    if (map_items != nullptr)
+        munmap(map_items, map_capacity * sizeof(map_item));
+
+    map_items = items;
+    map_capacity = capacity;
+    return true;
+}
+/**
+ * It adds item per O(1*)
+ *
+ * \return false, if no memory
+ **/
+static bool map_insert(map_item item) {
+    if (2 * (map_size + 1) > map_capacity && !map_grow())
+        return false;
+
+    map_place(map_items, map_capacity, item);
+    map_size++;
+    return true;
+}
+/**
+ * \return item of aligment_ptr per O(1) or nullptr
+ **/
+static map_item * map_find(void * aligment_ptr) {
+    if (map_capacity == 0)
+        return nullptr;
+
+    size_t idx = map_hash(aligment_ptr) & (map_capacity - 1);
+
+    while (map_items[idx].aligment_ptr != nullptr) {
+        if (map_items[idx].aligment_ptr == aligment_ptr)
+            return &map_items[idx];
+        idx = (idx + 1) & (map_capacity - 1);
+    }
+    return nullptr;
+}
+/**
+ * It removes item per O(1) and shifts back the next items
+ * of its probe sequence, so the table needs no tombstones
+ **/
+static void map_erase(map_item * item) {
+    size_t hole = item - map_items;
+    size_t idx = hole;
+
+    while (true) {
+        idx = (idx + 1) & (map_capacity - 1);
+        if (map_items[idx].aligment_ptr == nullptr)
+            break;
+
+        size_t home = map_hash(map_items[idx].aligment_ptr) & (map_capacity - 1);
+
+        // item stays, if its home is cyclically in (hole, idx]
+        if (((idx - home) & (map_capacity - 1)) < ((idx - hole) & (map_capacity - 1)))
+            continue;
+
+        map_items[hole] = map_items[idx];
+        hole = idx;
+    }
+
+    map_items[hole] = {nullptr, 0};
+    map_size--;
+}
+
 
 /**
- * It allocate memory for SLAB allocator.
- * It need for imitation BUDDY allocator,
- * which allocate big memory with
- * natural alignment
+ * It allocate memory for SLAB allocator
+ * from the buddy allocator, which allocate
+ * big memory with natural alignment
  *
  * \param order - degree of 2 (2^order), order [0,18]
  * in memory it is [4KiB, 1GiB]
+ * \param is_slab - memory is a slab with meta_block at its end,
+ * slab_kfree finds the owner cache of objects through it
+ * \param owner - memory is a large object of the cache, slab_kfree
+ * comes it back into the cache
  *
  * \return pointer to memory, that is aligment on
- * size = PAGE_SIZE * (1 << order)
+ * size = PAGE_SIZE * (1 << order), or nullptr if no memory
  **/
-static void * alloc_slab(int order) {
+static void * alloc_slab(int order, bool is_slab = false, struct cache * owner = nullptr) {
     assert(0 <= order && order <= 18);
 
-    const int shift = PAGE_SIZE_DEGREE_2 + order;
-    const size_t SLAB_SIZE = PAGE_SIZE * (1 << order);
-
-    void * allocated_ptr = malloc(2*SLAB_SIZE);
-    size_t aligment_numptr = (((size_t)allocated_ptr >> shift) << shift);
-    void * aligment_ptr = (void *)(aligment_numptr + SLAB_SIZE);
+    pthread_lock_quard lock(PAGE_MTX);
 
-    for (int i = 0; i < max_map_items; i++)
-    if (map_item_array[i].allocated_ptr == nullptr) {
+    void * aligment_ptr = buddy_alloc(order);
+    if (aligment_ptr == nullptr)
+        return nullptr;
 
-        map_item_array[i].allocated_ptr = allocated_ptr;
-        map_item_array[i].aligment_ptr = aligment_ptr;
-        break;
+    if (!map_insert({aligment_ptr, order})) {
+        buddy_free(aligment_ptr, order);
+        return nullptr;
     }
 
+    if (is_slab)
+        *buddy_alloc_mark(aligment_ptr) |= BUDDY_SLAB;
+    if (owner != nullptr)
+        *buddy_alloc_owner(aligment_ptr) = owner;
+
     return aligment_ptr;
 }
 /**
@@ -126,13 +686,14 @@ static void * alloc_slab(int order) {
  * by alloc_slab. If no such pointer, then exit(1)
  **/
 static void free_slab(void *slab) {
-    for (int i = 0; i < max_map_items; i++)
-    if (map_item_array[i].aligment_ptr == slab) {
-        free(map_item_array[i].allocated_ptr);
-        map_item_array[i] = {nullptr, nullptr};
-        return;
-    }
-    exit(1);
+    pthread_lock_quard lock(PAGE_MTX);
+
+    map_item * item = map_find(slab);
+    if (item == nullptr)
+        exit(1);
+
+    buddy_free(slab, item->order);
+    map_erase(item);
 }
 
 
@@ -140,9 +701,9 @@ static void free_slab(void *slab) {
  * Debug logs          *
  *                     *
  ***********************/
+// dump_slab has no cache to lock: call it only
+// while no other thread works with the owning cache
 extern "C" void dump_slab(meta_block const * slab) {
-    pthread_lock_quard lock(MTX);
-
     printf("Slab [%p][%lu]\n", slab, (uint64_t)slab);
     if (slab == nullptr)
         return;
@@ -158,10 +719,12 @@ extern "C" void dump_slab(meta_block const * slab) {
         data = data->next;
         idx++;
     }
+
+    printf("Unused tail [%p]\n", slab->unused);
 }
 extern "C" void dump_cache(struct cache const * cache) {
     assert(cache != nullptr);
-    pthread_lock_quard lock(MTX);
+    pthread_lock_quard lock(cache->mtx);
 
     printf("Cache [%p][%lu]\n", cache, (uint64_t)cache);
     printf("\tslab_order=%d\n", cache->slab_order);
@@ -170,7 +733,13 @@ extern "C" void dump_cache(struct cache const * cache) {
     printf("\tmeta_block_offset=%zu\n", cache->meta_block_offset);
     printf("\tfree_list_slabs\t[%p]\n", cache->free_list_slabs);
     printf("\tbusy_list_slabs\t[%p]\n", cache->busy_list_slabs);
-    printf("\tpart_list_slabs\t[%p]\n", cache->partbusy_list_slabs);
+    for (int i = 0; i < CNT_PARTBUSY_BINS; i++)
+        printf("\tpart_list_slabs[%d]\t[%p]\n", i, cache->partbusy_list_slabs[i]);
+    printf("\tmagazine_size=%zu\n", cache->magazine_size);
+    printf("\tdepot_cnt_full=%zu\n", cache->depot_cnt_full);
+    printf("\tdepot_cnt_empty=%zu\n", cache->depot_cnt_empty);
+    printf("\tlarge_order=%d\n", cache->large_order);
+    printf("\tcnt_large_stash=%zu\n", cache->cnt_large_stash);
 }
 
 
@@ -178,243 +747,2353 @@ extern "C" void dump_cache(struct cache const * cache) {
  * Support handlers    *
  *                     *
  ***********************/
+/**
+ * It takes new slab per O(1). Objects are carved from
+ * the unused tail on demand, so pages of slab are touched
+ * only when its objects are allocated
+ **/
 static meta_block * slab_setup(struct cache *cache) {
     assert(cache != nullptr);
 
-    void * slab_ptr = alloc_slab(cache->slab_order);
-    assert(slab_ptr != nullptr);
+    void * slab_ptr = alloc_slab(cache->slab_order, true);
+    if (slab_ptr == nullptr)
+        return nullptr;
 
-    size_t offset = cache->meta_block_offset;
-    meta_block * meta = (meta_block *)((uint8_t *)slab_ptr + offset);
+    meta_block * meta = (meta_block *)((uint8_t *)slab_ptr + cache->meta_block_offset);
     meta->next = nullptr;
-    meta->head = (data_block *)slab_ptr;
+    meta->prev = nullptr;
+    meta->head = nullptr;
+    meta->unused = (uint8_t *)slab_ptr;
     meta->cnt_objects = cache->cnt_objects;
+    meta->owner = cache;
+    meta->free_tagged = 0;
+    meta->pending_next = nullptr;
+    meta->heap = nullptr;
 
-    uint8_t * base = (uint8_t *)meta->head;
-
-    while (offset > cache->object_size) {
-        data_block * curr_block = (data_block *)(base);
-        data_block * next_block = (data_block *)(base + cache->object_size);
-
-        curr_block->next = next_block;
-        base = base + cache->object_size;
-        offset -= cache->object_size;
-    }
-
-    ((data_block *)base)->next = nullptr;
     return meta;
 }
-static meta_block * slab_pop(struct cache *cache, SlabType type) {
-    assert(cache != nullptr);
-    meta_block * ret_slab = nullptr;
+static inline data_block * object_link(struct cache *cache, void * ptr) {
+    return (data_block *)((uint8_t *)ptr + cache->link_offset);
+}
+static inline void * link_object(struct cache *cache, data_block * link) {
+    return (uint8_t *)link - cache->link_offset;
+}
+/**
+ * It carves next object from the unused tail and constructs it
+ **/
+static void * slab_carve(struct cache *cache, meta_block * meta) {
+    void * ptr = meta->unused;
+    meta->unused += cache->object_size;
 
-    switch (type) {
-        case SlabType::FREE:
-            ret_slab = cache->free_list_slabs;
-            cache->free_list_slabs = cache->free_list_slabs->next;
-            break;
-        case SlabType::BUSY:
-            ret_slab = cache->busy_list_slabs;
-            cache->busy_list_slabs = cache->busy_list_slabs->next;
-            break;
-        case SlabType::PARTBUSY:
-            ret_slab = cache->partbusy_list_slabs;
-            cache->partbusy_list_slabs = cache->partbusy_list_slabs->next;
-            break;
+    if (cache->ctor != nullptr)
+        cache->ctor(ptr);
+    return ptr;
+}
+/**
+ * It takes one object of slab: from the free list,
+ * otherwise from the unused tail. Slab must have free objects
+ **/
+static void * slab_take(struct cache *cache, meta_block * meta) {
+    void * ptr = nullptr;
+
+    if (meta->head != nullptr) {
+        ptr = link_object(cache, meta->head);
+        meta->head = meta->head->next;
+    } else {
+        ptr = slab_carve(cache, meta);
     }
 
-    return ret_slab;
+    meta->cnt_objects--;
+    return ptr;
 }
-static void slab_push(struct cache *cache, meta_block * block, SlabType type) {
-    assert(cache != nullptr && block != nullptr);
-
+static meta_block ** slab_list(struct cache *cache, SlabType type, int bin = 0) {
     switch (type) {
         case SlabType::FREE:
-            block->next = cache->free_list_slabs;
-            cache->free_list_slabs = block;
-            break;
+            return &cache->free_list_slabs;
         case SlabType::BUSY:
-            block->next = cache->busy_list_slabs;
-            cache->busy_list_slabs = block;
-            break;
+            return &cache->busy_list_slabs;
         case SlabType::PARTBUSY:
-            block->next = cache->partbusy_list_slabs;
-            cache->partbusy_list_slabs = block;
-            break;
+            return &cache->partbusy_list_slabs[bin];
     }
+    return nullptr;
 }
-static void list_slabs_release(meta_block * block, size_t offset) {
-    while (block != nullptr) {
-        void * slab = (uint8_t *)block - offset;
-        block = block->next;
-        free_slab(slab);
-    }
+/**
+ * \return bin of partially busy slab with cnt_free free objects
+ **/
+static int slab_bin_of(struct cache const *cache, size_t cnt_free) {
+    return (int)(cnt_free * CNT_PARTBUSY_BINS / (cache->cnt_objects + 1));
 }
-static pair<meta_block *,meta_block *> slab_find(meta_block * block, meta_block * root) {
-    meta_block * prev = nullptr;
-    meta_block * curr = root;
-
-    while (curr != nullptr) {
-        if (curr == block)
-            return make_pair(prev, curr);
-        prev = curr;
-        curr = curr->next;
-    }
-
-    return make_pair(nullptr, nullptr);
+/**
+ * \return the fullest partially busy slab or nullptr
+ **/
+static meta_block * slab_partbusy_first(struct cache const *cache) {
+    for (int i = 0; i < CNT_PARTBUSY_BINS; i++)
+        if (cache->partbusy_list_slabs[i] != nullptr)
+            return cache->partbusy_list_slabs[i];
+    return nullptr;
 }
+static void slab_list_push(meta_block ** root, meta_block * block) {
+    block->prev = nullptr;
+    block->next = *root;
+    if (*root != nullptr)
+        (*root)->prev = block;
+    *root = block;
+}
+static void slab_list_unlink(meta_block ** root, meta_block * block) {
+    if (block->prev != nullptr)
+        block->prev->next = block->next;
+    else
+        *root = block->next;
 
+    if (block->next != nullptr)
+        block->next->prev = block->prev;
 
-/***********************
- *          API        *
- *                     *
- ***********************/
-
+    block->prev = nullptr;
+    block->next = nullptr;
+}
 /**
- * It first initialize struct cache per O(1).
- * cache must be valid pointer on exist structure
- *
- * \param cache - structure, which need initialize
- * \object_size - size which you want allocate (must be > 0)
+ * It takes the head of list of such type, partially
+ * busy slab is taken from the fullest bin
  **/
-extern "C" void cache_setup(struct cache *cache, size_t object_size, int slab_order = 10) {
-    assert(cache != nullptr && object_size > 0);
-    pthread_lock_quard lock(MTX);
+static meta_block * slab_pop(struct cache *cache, SlabType type) {
+    assert(cache != nullptr);
+    meta_block ** root = slab_list(cache, type);
 
-    cache->object_size  = object_size + DATA_BLOCK_SIZE;
-    cache->slab_order   = slab_order;
+    if (type == SlabType::PARTBUSY)
+        root = slab_list(cache, type, slab_partbusy_first(cache)->bin);
+    meta_block * ret_slab = *root;
 
-    const size_t SLAB_SIZE = PAGE_SIZE * (1 << cache->slab_order); // 4 MiB
-    cache->cnt_objects  = SLAB_SIZE / cache->object_size;
+    *root = ret_slab->next;
+    if (*root != nullptr)
+        (*root)->prev = nullptr;
 
-    while (SLAB_SIZE - cache->cnt_objects * cache->object_size < META_BLOCK_SIZE)
-        cache->cnt_objects--;
-    assert(cache->cnt_objects > 0);
+    ret_slab->next = nullptr;
+    return ret_slab;
+}
+static void slab_push(struct cache *cache, meta_block * block, SlabType type) {
+    assert(cache != nullptr && block != nullptr);
 
-    cache->meta_block_offset = cache->cnt_objects * cache->object_size;
-    cache->free_list_slabs = slab_setup(cache);
+    if (type == SlabType::PARTBUSY)
+        block->bin = slab_bin_of(cache, block->cnt_objects);
+    slab_list_push(slab_list(cache, type, block->bin), block);
 }
 /**
- * It deallocates all slabs (by free_slab)
- * and fill struct cache by zero per O(K),
- * K - count of slabs.
- * cache must be valid structure, otherwise undefined behavior
+ * It removes block from list of such type per O(1),
+ * block must be in this list
  **/
-extern "C" void cache_release(struct cache *cache) {
-    assert(cache != nullptr);
-    pthread_lock_quard lock(MTX);
+static void slab_unlink(struct cache *cache, meta_block * block, SlabType type) {
+    assert(cache != nullptr && block != nullptr);
+    slab_list_unlink(slab_list(cache, type, block->bin), block);
+}
+/**
+ * It moves partially busy slab into other bin,
+ * if count of its free objects has left its bin
+ **/
+static void slab_rebin(struct cache *cache, meta_block * block) {
+    if (slab_bin_of(cache, block->cnt_objects) == block->bin)
+        return;
 
-    list_slabs_release(cache->free_list_slabs, cache->meta_block_offset);
-    list_slabs_release(cache->busy_list_slabs, cache->meta_block_offset);
-    list_slabs_release(cache->partbusy_list_slabs, cache->meta_block_offset);
-    *cache = {0,0,0,0,nullptr,nullptr,nullptr};
+    slab_unlink(cache, block, SlabType::PARTBUSY);
+    slab_push(cache, block, SlabType::PARTBUSY);
 }
 /**
- * It allocate one block of memory >= object_size per O(1).
- * cache must be valid structure, otherwise undefined behavior.
+ * It releases slabs of list, all carved objects
+ * of them are destroyed before, if cache has dtor
+ **/
+static void list_slabs_release(struct cache *cache, meta_block * block) {
+    while (block != nullptr) {
+        uint8_t * slab = (uint8_t *)block - cache->meta_block_offset;
+
+        if (cache->dtor != nullptr)
+            for (uint8_t * ptr = slab; ptr < block->unused; ptr += cache->object_size)
+                cache->dtor(ptr);
+
+        block = block->next;
+        free_slab(slab);
+    }
+}
+
+/**
+ * It takes one object from partially busy or free slabs.
+ * cache->mtx must be held.
  *
- * \return pointer to memory
+ * \return pointer to memory or nullptr, if cache has no free objects
  **/
-extern "C" void *cache_alloc(struct cache *cache) {
-    assert(cache != nullptr);
+static void * slab_object_alloc(struct cache *cache) {
+    void * free_block = nullptr;
 
-    pthread_lock_quard lock(MTX);
-    data_block * free_block = nullptr;
+    meta_block * partbusy_block = slab_partbusy_first(cache);
 
-    if (cache->partbusy_list_slabs != nullptr) {
-        free_block = cache->partbusy_list_slabs->head;
-        cache->partbusy_list_slabs->head = free_block->next;
-        cache->partbusy_list_slabs->cnt_objects--;
+    if (partbusy_block != nullptr) {
+        free_block = slab_take(cache, partbusy_block);
 
-        if (free_block->next == nullptr) {
-            meta_block * new_busy_block = slab_pop(cache, SlabType::PARTBUSY);
-            slab_push(cache, new_busy_block, SlabType::BUSY);
+        if (partbusy_block->cnt_objects == 0) {
+            slab_unlink(cache, partbusy_block, SlabType::PARTBUSY);
+            slab_push(cache, partbusy_block, SlabType::BUSY);
+        } else {
+            slab_rebin(cache, partbusy_block);
         }
     } else if (cache->free_list_slabs != nullptr) {
-        free_block = cache->free_list_slabs->head;
-        cache->free_list_slabs->head = cache->free_list_slabs->head->next;
-        cache->free_list_slabs->cnt_objects--;
+        free_block = slab_take(cache, cache->free_list_slabs);
 
         meta_block * new_busy_block = slab_pop(cache, SlabType::FREE);
-        if (free_block->next == nullptr)
+        if (new_busy_block->cnt_objects == 0)
             slab_push(cache, new_busy_block, SlabType::BUSY);
         else
             slab_push(cache, new_busy_block, SlabType::PARTBUSY);
-    } else {
-        meta_block * new_free_block = slab_setup(cache);
-
-        if (new_free_block != nullptr) {
-            slab_push(cache, new_free_block, SlabType::FREE);
-
-            lock.manual_unlock();
-            return cache_alloc(cache);
-        }
     }
 
-    if (free_block != nullptr) {
-        free_block->next = nullptr;
-        return ((uint8_t *)free_block + DATA_BLOCK_SIZE);
-    } else {
-        return nullptr;
-    }
+    return free_block;
 }
 /**
- * It come back one block into slab per O(1*).
+ * It takes up to cnt objects into ptrs, the cache
+ * grows by new slabs if need. Every slab gives a run of
+ * its free list and unused tail at once and is moved
+ * between lists at most once. cache->mtx must be held,
+ * it is released while new slab is set up
  *
- * \param ptr - pointer to allocated memory before.
- * If is not valid pointer - undefined behavior
+ * \return count of allocated objects
  **/
-extern "C" void cache_free(struct cache *cache, void *ptr) {
-    pthread_lock_quard lock(MTX);
-
-    const int shift = PAGE_SIZE_DEGREE_2 + cache->slab_order;
+static size_t slab_objects_alloc(struct cache *cache, void ** ptrs, size_t cnt) {
+    size_t i = 0;
 
-    size_t aligment_numptr = (((size_t)ptr >> shift) << shift);
+    while (i < cnt) {
+        SlabType type = SlabType::PARTBUSY;
+        meta_block * meta = slab_partbusy_first(cache);
 
-    data_block * dblock = (data_block *)((uint8_t *)ptr - DATA_BLOCK_SIZE);
-    meta_block * mblock = (meta_block *)(aligment_numptr + cache->meta_block_offset);
+        if (meta == nullptr) {
+            type = SlabType::FREE;
+            meta = cache->free_list_slabs;
+        }
 
-    dblock->next = mblock->head;
-    mblock->head = dblock;
-    mblock->cnt_objects++;
+        if (meta == nullptr) {
+            // slab is set up without lock, it is not seen by other
+            // threads till the push, then it is taken while locked
+            pthread_mutex_unlock(&cache->mtx);
+            meta_block * new_free_block = slab_setup(cache);
+            pthread_mutex_lock(&cache->mtx);
 
-    if (mblock->cnt_objects == 1) {
-        auto [prev, curr] = slab_find(mblock, cache->busy_list_slabs);
-        assert(curr != nullptr);
+            if (new_free_block == nullptr)
+                break;
 
-        if (prev != nullptr) {
-            prev->next = curr->next;
-            curr->next = cache->busy_list_slabs;
-            cache->busy_list_slabs = curr;
+            slab_push(cache, new_free_block, SlabType::FREE);
+            continue;
         }
 
-        if (mblock->cnt_objects == cache->cnt_objects)
-            slab_push(cache, slab_pop(cache, SlabType::BUSY), SlabType::FREE);
-        else
-            slab_push(cache, slab_pop(cache, SlabType::BUSY), SlabType::PARTBUSY);
-    } else if (mblock->cnt_objects == cache->cnt_objects) {
-        auto [prev, curr] = slab_find(mblock, cache->partbusy_list_slabs);
-        assert(curr != nullptr);
+        size_t take = min(cnt - i, meta->cnt_objects);
+        meta->cnt_objects -= take;
 
-        if (prev != nullptr) {
-            prev->next = curr->next;
-            curr->next = cache->partbusy_list_slabs;
-            cache->partbusy_list_slabs = curr;
+        data_block * free_block = meta->head;
+        for (; take > 0 && free_block != nullptr; take--) {
+            ptrs[i++] = link_object(cache, free_block);
+            free_block = free_block->next;
         }
+        meta->head = free_block;
+
+        for (; take > 0; take--)
+            ptrs[i++] = slab_carve(cache, meta);
 
-        slab_push(cache, slab_pop(cache, SlabType::PARTBUSY), SlabType::FREE);
+        if (type == SlabType::FREE || meta->cnt_objects == 0) {
+            slab_unlink(cache, meta, type);
+            slab_push(cache, meta, meta->cnt_objects == 0 ? SlabType::BUSY : SlabType::PARTBUSY);
+        } else {
+            slab_rebin(cache, meta);
+        }
     }
+
+    return i;
 }
-/**
- * It release all free slabs, if such exist
- **/
+static meta_block * slab_meta_of(struct cache *cache, void *ptr) {
+    const int shift = PAGE_SIZE_DEGREE_2 + cache->slab_order;
+
+    size_t aligment_numptr = (((size_t)ptr >> shift) << shift);
+    return (meta_block *)(aligment_numptr + cache->meta_block_offset);
+}
+/**
+ * It splices chain of cnt free objects [first..last] of slab
+ * into its free list and moves slab between lists at most once.
+ * cache->mtx must be held.
+ **/
+static void slab_splice(struct cache *cache, meta_block * mblock,
+                        data_block * first, data_block * last, size_t cnt) {
+    last->next = mblock->head;
+    mblock->head = first;
+    mblock->cnt_objects += cnt;
+
+    if (mblock->cnt_objects == cnt) {
+        slab_unlink(cache, mblock, SlabType::BUSY);
+
+        if (mblock->cnt_objects == cache->cnt_objects)
+            slab_push(cache, mblock, SlabType::FREE);
+        else
+            slab_push(cache, mblock, SlabType::PARTBUSY);
+    } else if (mblock->cnt_objects == cache->cnt_objects) {
+        slab_unlink(cache, mblock, SlabType::PARTBUSY);
+        slab_push(cache, mblock, SlabType::FREE);
+    } else {
+        slab_rebin(cache, mblock);
+    }
+}
+/**
+ * It come back one object into its slab.
+ * cache->mtx must be held.
+ **/
+static void slab_object_free(struct cache *cache, void *ptr) {
+    data_block * dblock = object_link(cache, ptr);
+    slab_splice(cache, slab_meta_of(cache, ptr), dblock, dblock, 1);
+}
+/**
+ * It pushes object into remote free list of cache by one CAS,
+ * no lock is taken
+ **/
+static void slab_remote_push(struct cache *cache, void *ptr) {
+    data_block * dblock = object_link(cache, ptr);
+    dblock->next = __atomic_load_n(&cache->remote_free, __ATOMIC_RELAXED);
+
+    while (!__atomic_compare_exchange_n(&cache->remote_free, &dblock->next, dblock, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+/**
+ * It takes whole remote free list of cache and splices its runs
+ * of objects of the same slab into slabs. cache->mtx must be held
+ **/
+static void slab_remote_drain(struct cache *cache) {
+    if (__atomic_load_n(&cache->remote_free, __ATOMIC_RELAXED) == nullptr)
+        return;
+
+    data_block * dblock = __atomic_exchange_n(&cache->remote_free, nullptr, __ATOMIC_ACQUIRE);
+
+    while (dblock != nullptr) {
+        meta_block * mblock = slab_meta_of(cache, dblock);
+        data_block * first = dblock;
+        data_block * last = dblock;
+        size_t cnt_chain = 1;
+
+        dblock = dblock->next;
+        while (dblock != nullptr && slab_meta_of(cache, dblock) == mblock) {
+            last = dblock;
+            dblock = dblock->next;
+            cnt_chain++;
+        }
+
+        slab_splice(cache, mblock, first, last, cnt_chain);
+    }
+}
+/**
+ * It pushes object into lock-free list of its slab by CAS on tagged
+ * word, then the first push since the last drain publishes the slab
+ * in pending_slabs by one more CAS. It never blocks. Slab with
+ * pending bit is not released, so no field of it is touched after
+ **/
+static void slab_lockfree_push(struct cache *cache, void *ptr) {
+    meta_block * meta = slab_meta_of(cache, ptr);
+    uint8_t * slab = (uint8_t *)meta - cache->meta_block_offset;
+    data_block * dblock = object_link(cache, ptr);
+    const uint64_t offset = (uint8_t *)dblock - slab + 1;
+
+    uint64_t word = __atomic_load_n(&meta->free_tagged, __ATOMIC_RELAXED);
+    uint64_t new_word = 0;
+
+    do {
+        const uint64_t head = word & LOCKFREE_OFFSET_MASK;
+        dblock->next = head != 0 ? (data_block *)(slab + head - 1) : nullptr;
+        new_word = ((word & ~LOCKFREE_OFFSET_MASK) + LOCKFREE_TAG) | LOCKFREE_PENDING | offset;
+    // acquire: if pending bit was cleared by drain, its read
+    // of pending_next happens before the write below
+    } while (!__atomic_compare_exchange_n(&meta->free_tagged, &word, new_word, true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    if (word & LOCKFREE_PENDING)
+        return;
+
+    meta_block * pending = __atomic_load_n(&cache->pending_slabs, __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(&meta->pending_next, pending, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&cache->pending_slabs, &pending, meta, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+/**
+ * It takes lock-free lists of all pending slabs (clearing pending
+ * bit) and splices them into slabs, so slabs are moved between
+ * lists lazily, here. cache->mtx must be held
+ **/
+static void slab_pending_drain(struct cache *cache) {
+    if (__atomic_load_n(&cache->pending_slabs, __ATOMIC_RELAXED) == nullptr)
+        return;
+
+    meta_block * meta = __atomic_exchange_n(&cache->pending_slabs, nullptr, __ATOMIC_ACQUIRE);
+
+    while (meta != nullptr) {
+        // pending_next is rewritten by next push, when bit is clear
+        meta_block * next = __atomic_load_n(&meta->pending_next, __ATOMIC_RELAXED);
+        uint64_t word = __atomic_load_n(&meta->free_tagged, __ATOMIC_RELAXED);
+        uint64_t new_word = 0;
+
+        do {
+            new_word = (word & ~(LOCKFREE_OFFSET_MASK | LOCKFREE_PENDING)) + LOCKFREE_TAG;
+        } while (!__atomic_compare_exchange_n(&meta->free_tagged, &word, new_word, true,
+                                              __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+        const uint64_t head = word & LOCKFREE_OFFSET_MASK;
+        if (head != 0) {
+            uint8_t * slab = (uint8_t *)meta - cache->meta_block_offset;
+            data_block * first = (data_block *)(slab + head - 1);
+            data_block * last = first;
+            size_t cnt_chain = 1;
+
+            while (last->next != nullptr) {
+                last = last->next;
+                cnt_chain++;
+            }
+            slab_splice(cache, meta, first, last, cnt_chain);
+        }
+
+        meta = next;
+    }
+}
+/**
+ * It come back cnt objects into slabs per O(cnt * log(cnt)).
+ * ptrs is sorted by address, so objects of one slab are in a row:
+ * they are chained and spliced at once, and every slab is moved
+ * between lists at most once for any order of ptrs.
+ * Pointers are replaced by nullptr. cache->mtx must be held.
+ **/
+static void slab_objects_free(struct cache *cache, void ** ptrs, size_t cnt) {
+    std::sort(ptrs, ptrs + cnt, [](void * a, void * b) { return (size_t)a < (size_t)b; });
+
+    size_t i = 0;
+    while (i < cnt && ptrs[i] == nullptr)
+        i++;
+
+    while (i < cnt) {
+        meta_block * mblock = slab_meta_of(cache, ptrs[i]);
+        data_block * first = object_link(cache, ptrs[i]);
+        data_block * last = first;
+        size_t cnt_chain = 1;
+
+        ptrs[i++] = nullptr;
+        while (i < cnt && slab_meta_of(cache, ptrs[i]) == mblock) {
+            data_block * dblock = object_link(cache, ptrs[i]);
+            dblock->next = first;
+            first = dblock;
+            cnt_chain++;
+            ptrs[i++] = nullptr;
+        }
+
+        slab_splice(cache, mblock, first, last, cnt_chain);
+    }
+}
+
+
+/***********************
+ * Magazine layer      *
+ * (per-thread stacks  *
+ * of free objects)    *
+ ***********************/
+
+extern "C" void cache_setup(struct cache *cache, size_t object_size, int slab_order,
+                            int flags, void (*ctor)(void *), void (*dtor)(void *));
+extern "C" void *cache_alloc(struct cache *cache);
+extern "C" void cache_free(struct cache *cache, void *ptr);
+
+/**
+ * Count of rounds in magazine for such object_size.
+ * Big objects are rare and expensive to keep per thread,
+ * so for them the magazine layer is off (returns 0)
+ **/
+static size_t magazine_size_for(size_t object_size) {
+    if (object_size > CACHE_LARGE_SIZE)
+        return 0;
+    if (object_size > 4 * (1 << 10))
+        return 8;
+    if (object_size > (1 << 10))
+        return 16;
+    if (object_size > 256)
+        return 32;
+    return MAGAZINE_MAX_ROUNDS;
+}
+static magazine * magazine_new() {
+    magazine * mag = (magazine *)cache_alloc(&magazine_cache);
+
+    if (mag != nullptr) {
+        mag->next = nullptr;
+        mag->cnt_rounds = 0;
+    }
+    return mag;
+}
+static void magazine_delete(magazine * mag) {
+    if (mag != nullptr)
+        cache_free(&magazine_cache, mag);
+}
+/**
+ * It come back all rounds into slabs.
+ * cache->mtx must be held
+ **/
+static void magazine_flush(struct cache *cache, magazine * mag) {
+    slab_objects_free(cache, mag->rounds, mag->cnt_rounds);
+    mag->cnt_rounds = 0;
+}
+/**
+ * It puts magazine into depot. Partially filled magazines
+ * and magazines over DEPOT_MAX_MAGAZINES are flushed into slabs.
+ * cache->mtx must be held
+ **/
+static void depot_put(struct cache *cache, magazine * mag) {
+    if (mag == nullptr)
+        return;
+
+    if (mag->cnt_rounds == cache->magazine_size &&
+        cache->depot_cnt_full < DEPOT_MAX_MAGAZINES) {
+        mag->next = cache->depot_full_magazines;
+        cache->depot_full_magazines = mag;
+        cache->depot_cnt_full++;
+        return;
+    }
+
+    magazine_flush(cache, mag);
+
+    if (cache->depot_cnt_empty < DEPOT_MAX_MAGAZINES) {
+        mag->next = cache->depot_empty_magazines;
+        cache->depot_empty_magazines = mag;
+        cache->depot_cnt_empty++;
+    } else {
+        magazine_delete(mag);
+    }
+}
+/**
+ * \return full magazine from depot or nullptr.
+ * cache->mtx must be held
+ **/
+static magazine * depot_get_full(struct cache *cache) {
+    magazine * mag = cache->depot_full_magazines;
+
+    if (mag != nullptr) {
+        cache->depot_full_magazines = mag->next;
+        cache->depot_cnt_full--;
+    }
+    return mag;
+}
+/**
+ * \return empty magazine from depot or new one (nullptr, if no memory).
+ * cache->mtx must be held
+ **/
+static magazine * depot_get_empty(struct cache *cache) {
+    magazine * mag = cache->depot_empty_magazines;
+
+    if (mag == nullptr)
+        return magazine_new();
+
+    cache->depot_empty_magazines = mag->next;
+    cache->depot_cnt_empty--;
+    return mag;
+}
+/**
+ * It deletes all magazines of depot, rounds are returned into
+ * slabs if flush, otherwise they are lost together with slabs.
+ * cache->mtx must be held
+ **/
+static void depot_release(struct cache *cache, bool flush) {
+    while (cache->depot_full_magazines != nullptr) {
+        magazine * mag = depot_get_full(cache);
+        if (flush)
+            magazine_flush(cache, mag);
+        magazine_delete(mag);
+    }
+    while (cache->depot_empty_magazines != nullptr) {
+        magazine * mag = cache->depot_empty_magazines;
+        cache->depot_empty_magazines = mag->next;
+        magazine_delete(mag);
+    }
+    cache->depot_cnt_empty = 0;
+}
+/**
+ * It finds slot of thread tables, that no registered cache uses,
+ * otherwise caches share slots by id. REGISTRY_MTX must be held
+ **/
+static int registry_free_slot(uint64_t id) {
+    bool used[THREAD_MAGAZINE_SLOTS] = {};
+
+    for (cache * owner = cache_registry; owner != nullptr; owner = owner->registry_next)
+        used[owner->tls_slot] = true;
+
+    for (int i = 0; i < THREAD_MAGAZINE_SLOTS; i++)
+        if (!used[i])
+            return i;
+    return (int)(id % THREAD_MAGAZINE_SLOTS);
+}
+/**
+ * \return owner, if it is still registered with the id, otherwise
+ * nullptr (cache is released). REGISTRY_MTX must be held
+ **/
+static cache * registry_find(cache * owner, uint64_t id) {
+    cache * curr = cache_registry;
+
+    while (curr != nullptr && (curr != owner || curr->id != id))
+        curr = curr->registry_next;
+    return curr;
+}
+/**
+ * \return slot of the current thread for cache in table of thread
+ * (tls_magazines or tls_heaps). Slot of other cache in the same
+ * place is flushed before. The table is registered by key once,
+ * the value is only a trigger of destructor of key at thread exit
+ **/
+template <typename Slot>
+static Slot * thread_slot_of(struct cache *cache, Slot * table, bool * registered,
+                             pthread_key_t key, void (*flush)(Slot *)) {
+    Slot * slot = &table[cache->tls_slot];
+
+    if (slot->cache_id == cache->id)
+        return slot;
+
+    if (!*registered) {
+        pthread_setspecific(key, table);
+        *registered = true;
+    }
+
+    flush(slot);
+    return slot;
+}
+template <typename Slot>
+static void thread_slots_flush(Slot * table, void (*flush)(Slot *)) {
+    for (int i = 0; i < THREAD_MAGAZINE_SLOTS; i++)
+        flush(&table[i]);
+}
+/**
+ * It come back magazines of the thread slot into depot of its cache.
+ * If the cache has been released, then the rounds died with its slabs
+ **/
+static void magazine_slot_flush(thread_magazines * slot) {
+    if (slot->cache_id == 0)
+        return;
+
+    pthread_lock_quard registry_lock(REGISTRY_MTX);
+    cache * owner = registry_find(slot->owner, slot->cache_id);
+
+    if (owner != nullptr) {
+        pthread_lock_quard lock(owner->mtx);
+        depot_put(owner, slot->loaded);
+        depot_put(owner, slot->previous);
+    } else {
+        magazine_delete(slot->loaded);
+        magazine_delete(slot->previous);
+    }
+
+    *slot = {0, nullptr, nullptr, nullptr};
+}
+static void magazine_thread_exit(void * arg) {
+    (void) arg;
+    thread_slots_flush(tls_magazines, magazine_slot_flush);
+}
+static void magazine_init() {
+    cache_setup(&magazine_cache, sizeof(magazine), 2, CACHE_NO_MAGAZINES, nullptr, nullptr);
+    pthread_key_create(&magazine_key, magazine_thread_exit);
+}
+/**
+ * \return magazines of the current thread for cache
+ **/
+static thread_magazines * magazine_slot(struct cache *cache) {
+    thread_magazines * slot = thread_slot_of(cache, tls_magazines, &tls_magazines_registered,
+                                             magazine_key, magazine_slot_flush);
+    slot->cache_id = cache->id;
+    slot->owner = cache;
+    return slot;
+}
+/**
+ * It allocates object from magazines of the current thread.
+ * The cache is locked only to exchange magazines with depot
+ * or to fill magazine from slabs
+ **/
+static void * magazine_alloc(struct cache *cache) {
+    thread_magazines * slot = magazine_slot(cache);
+
+    if (slot->loaded == nullptr || slot->loaded->cnt_rounds == 0) {
+        if (slot->previous != nullptr && slot->previous->cnt_rounds > 0) {
+            swap(slot->loaded, slot->previous);
+        } else {
+            pthread_lock_quard lock(cache->mtx);
+            magazine * full = depot_get_full(cache);
+
+            if (full != nullptr) {
+                depot_put(cache, slot->previous);
+                slot->previous = slot->loaded;
+                slot->loaded = full;
+            } else {
+                if (slot->loaded == nullptr)
+                    slot->loaded = depot_get_empty(cache);
+
+                if (slot->loaded == nullptr) {
+                    void * ptr = nullptr;
+                    slab_objects_alloc(cache, &ptr, 1);
+                    return ptr;
+                }
+
+                slot->loaded->cnt_rounds = slab_objects_alloc(cache,
+                    slot->loaded->rounds, cache->magazine_size);
+                if (slot->loaded->cnt_rounds == 0)
+                    return nullptr;
+            }
+        }
+    }
+
+    return slot->loaded->rounds[--slot->loaded->cnt_rounds];
+}
+/**
+ * It frees object into magazines of the current thread.
+ * The cache is locked only to exchange magazines with depot
+ **/
+static void magazine_free(struct cache *cache, void *ptr) {
+    thread_magazines * slot = magazine_slot(cache);
+
+    if (slot->loaded == nullptr || slot->loaded->cnt_rounds == cache->magazine_size) {
+        if (slot->previous != nullptr && slot->previous->cnt_rounds == 0) {
+            swap(slot->loaded, slot->previous);
+        } else {
+            pthread_lock_quard lock(cache->mtx);
+
+            depot_put(cache, slot->previous);
+            slot->previous = nullptr;
+
+            magazine * empty = depot_get_empty(cache);
+            if (empty == nullptr) {
+                slab_object_free(cache, ptr);
+                return;
+            }
+
+            slot->previous = slot->loaded;
+            slot->loaded = empty;
+        }
+    }
+
+    slot->loaded->rounds[slot->loaded->cnt_rounds++] = ptr;
+}
+
+
+/***********************
+ * Per-CPU layer       *
+ * (restartable        *
+ * sequences, rseq)    *
+ ***********************/
+
+static const int RSEQ_OK    = 0;
+static const int RSEQ_FAIL  = 1; // slot is empty, full or locked
+static const int RSEQ_ABORT = 2; // preempted or migrated, try again
+
+static pthread_once_t percpu_once = PTHREAD_ONCE_INIT;
+static bool percpu_available = false;
+static bool percpu_can_drain = false;
+static int percpu_cnt_cpus = 0;
+
+#ifdef SLAB_HAVE_RSEQ
+static inline struct rseq * rseq_area() {
+    return (struct rseq *)((uint8_t *)__builtin_thread_pointer() + __rseq_offset);
+}
+/**
+ * \return CPU of the current thread or -1, if rseq is not registered
+ **/
+static inline int rseq_cpu() {
+    int cpu = (int)__atomic_load_n(&rseq_area()->cpu_id, __ATOMIC_RELAXED);
+    return (0 <= cpu && cpu < percpu_cnt_cpus) ? cpu : -1;
+}
+/**
+ * It pops one object from slot of cpu. Commit is the store of
+ * cnt_objects, the kernel restarts the sequence (4:) if the thread
+ * is preempted or migrated before it
+ **/
+static inline int rseq_pop(percpu_slot * slot, int cpu, void ** obj) {
+    struct rseq * rs = rseq_area();
+    int status;
+    void * ret;
+
+    asm volatile(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz 4f\n\t"
+        "cmpq $0, %[locked]\n\t"
+        "jnz 5f\n\t"
+        "movq %[cnt], %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz 5f\n\t"
+        "movq -8(%[objects], %%rcx, 8), %[ret]\n\t"
+        "decq %%rcx\n\t"
+        "movq %%rcx, %[cnt]\n\t"
+        "2:\n\t"
+        "movl %[ok], %[status]\n\t"
+        "jmp 6f\n\t"
+        "5:\n\t"
+        "movl %[fail], %[status]\n\t"
+        "jmp 6f\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long 0x53053053\n\t" // RSEQ_SIG
+        "4:\n\t"
+        "movl %[abort], %[status]\n\t"
+        "jmp 6f\n\t"
+        ".popsection\n\t"
+        "6:\n\t"
+        : [status] "=&r" (status), [ret] "=&r" (ret),
+          [cnt] "+m" (slot->cnt_objects), [rseq_cs] "=m" (rs->rseq_cs)
+        : [cpu] "r" (cpu), [cpu_id] "m" (rs->cpu_id),
+          [locked] "m" (slot->locked), [objects] "r" (slot->objects),
+          [ok] "i" (RSEQ_OK), [fail] "i" (RSEQ_FAIL), [abort] "i" (RSEQ_ABORT)
+        : "rax", "rcx", "memory", "cc");
+
+    if (status == RSEQ_OK) {
+#ifdef __SANITIZE_THREAD__
+        __tsan_acquire(slot);
+#endif
+        *obj = ret;
+    }
+    return status;
+}
+/**
+ * It pushes one object into slot of cpu,
+ * commit is the store of cnt_objects
+ **/
+static inline int rseq_push(percpu_slot * slot, int cpu, void * obj) {
+    struct rseq * rs = rseq_area();
+    int status;
+
+#ifdef __SANITIZE_THREAD__
+    __tsan_release(slot);
+#endif
+
+    asm volatile(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz 4f\n\t"
+        "cmpq $0, %[locked]\n\t"
+        "jnz 5f\n\t"
+        "movq %[cnt], %%rcx\n\t"
+        "cmpq %[max], %%rcx\n\t"
+        "jae 5f\n\t"
+        "movq %[obj], (%[objects], %%rcx, 8)\n\t"
+        "incq %%rcx\n\t"
+        "movq %%rcx, %[cnt]\n\t"
+        "2:\n\t"
+        "movl %[ok], %[status]\n\t"
+        "jmp 6f\n\t"
+        "5:\n\t"
+        "movl %[fail], %[status]\n\t"
+        "jmp 6f\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long 0x53053053\n\t" // RSEQ_SIG
+        "4:\n\t"
+        "movl %[abort], %[status]\n\t"
+        "jmp 6f\n\t"
+        ".popsection\n\t"
+        "6:\n\t"
+        : [status] "=&r" (status),
+          [cnt] "+m" (slot->cnt_objects), [rseq_cs] "=m" (rs->rseq_cs)
+        : [cpu] "r" (cpu), [cpu_id] "m" (rs->cpu_id),
+          [locked] "m" (slot->locked), [objects] "r" (slot->objects),
+          [obj] "r" (obj), [max] "i" (PERCPU_MAX_OBJECTS),
+          [ok] "i" (RSEQ_OK), [fail] "i" (RSEQ_FAIL), [abort] "i" (RSEQ_ABORT)
+        : "rax", "rcx", "memory", "cc");
+
+    return status;
+}
+/**
+ * It aborts rseq critical sections, which run now on any CPU
+ **/
+static void rseq_fence() {
+    syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0, 0);
+}
+static void percpu_init() {
+    if (__rseq_size == 0)
+        return;
+
+    percpu_cnt_cpus = get_nprocs_conf();
+    percpu_available = percpu_cnt_cpus > 0;
+    percpu_can_drain = syscall(__NR_membarrier,
+        MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0) == 0;
+}
+#else
+static inline int rseq_cpu() { return -1; }
+static inline int rseq_pop(percpu_slot *, int, void **) { return RSEQ_FAIL; }
+static inline int rseq_push(percpu_slot *, int, void *) { return RSEQ_FAIL; }
+static void rseq_fence() {}
+static void percpu_init() {}
+#endif
+
+/**
+ * It allocates object from slot of the current CPU. An empty slot
+ * is refilled from slabs by PERCPU_BATCH objects under cache->mtx.
+ * Without rseq registration the object is taken from slabs directly
+ **/
+static void * percpu_alloc(struct cache *cache) {
+    int cpu;
+    void * ptr = nullptr;
+
+    while ((cpu = rseq_cpu()) >= 0) {
+        int status = rseq_pop(&cache->percpu_slots[cpu], cpu, &ptr);
+
+        if (status == RSEQ_OK)
+            return ptr;
+        if (status == RSEQ_FAIL)
+            break;
+    }
+
+    void * ptrs[PERCPU_BATCH];
+    size_t cnt = 0;
+    {
+        pthread_lock_quard lock(cache->mtx);
+        cnt = slab_objects_alloc(cache, ptrs, cpu >= 0 ? PERCPU_BATCH : 1);
+    }
+    if (cnt == 0)
+        return nullptr;
+
+    size_t i = 1;
+    while (i < cnt && (cpu = rseq_cpu()) >= 0) {
+        int status = rseq_push(&cache->percpu_slots[cpu], cpu, ptrs[i]);
+
+        if (status == RSEQ_OK)
+            i++;
+        else if (status == RSEQ_FAIL)
+            break;
+    }
+
+    if (i < cnt) {
+        pthread_lock_quard lock(cache->mtx);
+        slab_objects_free(cache, ptrs + i, cnt - i);
+    }
+
+    return ptrs[0];
+}
+/**
+ * It frees object into slot of the current CPU. A full slot
+ * is spilled into slabs by PERCPU_BATCH objects under cache->mtx
+ **/
+static void percpu_free(struct cache *cache, void *ptr) {
+    int cpu;
+
+    while ((cpu = rseq_cpu()) >= 0) {
+        int status = rseq_push(&cache->percpu_slots[cpu], cpu, ptr);
+
+        if (status == RSEQ_OK)
+            return;
+        if (status == RSEQ_FAIL)
+            break;
+    }
+
+    void * ptrs[PERCPU_BATCH];
+    size_t cnt = 0;
+
+    ptrs[cnt++] = ptr;
+    while (cnt < PERCPU_BATCH && (cpu = rseq_cpu()) >= 0) {
+        int status = rseq_pop(&cache->percpu_slots[cpu], cpu, &ptrs[cnt]);
+
+        if (status == RSEQ_OK)
+            cnt++;
+        else if (status == RSEQ_FAIL)
+            break;
+    }
+
+    pthread_lock_quard lock(cache->mtx);
+    slab_objects_free(cache, ptrs, cnt);
+}
+/**
+ * It come back objects of all CPU slots into slabs. Slots are locked
+ * first, then rseq_fence aborts sequences, which saw them unlocked.
+ * Without membarrier(2) slots of other CPUs can't be taken safely,
+ * so they are kept. cache->mtx must be held
+ **/
+static void percpu_drain(struct cache *cache) {
+    if (!percpu_can_drain)
+        return;
+
+    for (int cpu = 0; cpu < percpu_cnt_cpus; cpu++)
+        __atomic_store_n(&cache->percpu_slots[cpu].locked, 1, __ATOMIC_SEQ_CST);
+
+    rseq_fence();
+
+    for (int cpu = 0; cpu < percpu_cnt_cpus; cpu++) {
+        percpu_slot * slot = &cache->percpu_slots[cpu];
+
+#ifdef __SANITIZE_THREAD__
+        __tsan_acquire(slot);
+#endif
+        slab_objects_free(cache, slot->objects, slot->cnt_objects);
+        slot->cnt_objects = 0;
+
+#ifdef __SANITIZE_THREAD__
+        __tsan_release(slot);
+#endif
+        __atomic_store_n(&slot->locked, 0, __ATOMIC_SEQ_CST);
+    }
+}
+
+
+/***********************
+ * Large objects       *
+ *                     *
+ ***********************/
+
+/**
+ * It takes object from stash of cache, otherwise
+ * it allocates (and constructs) new one per O(1)
+ **/
+static void * large_alloc(struct cache *cache) {
+    pthread_lock_quard lock(cache->mtx);
+
+    if (cache->cnt_large_stash > 0)
+        return cache->large_stash[--cache->cnt_large_stash];
+    lock.manual_unlock();
+
+    void * ptr = alloc_slab(cache->large_order, false, cache);
+    if (ptr != nullptr && cache->ctor != nullptr)
+        cache->ctor(ptr);
+    return ptr;
+}
+/**
+ * It keeps object in stash of cache, if it is not
+ * full, otherwise it returns pages of object per O(1)
+ **/
+static void large_free(struct cache *cache, void *ptr) {
+    pthread_lock_quard lock(cache->mtx);
+
+    if (cache->cnt_large_stash < LARGE_STASH_MAX) {
+        cache->large_stash[cache->cnt_large_stash++] = ptr;
+        return;
+    }
+    lock.manual_unlock();
+
+    if (cache->dtor != nullptr)
+        cache->dtor(ptr);
+    free_slab(ptr);
+}
+/**
+ * It returns pages of all objects of stash. cache->mtx must be held
+ **/
+static void large_stash_release(struct cache *cache) {
+    while (cache->cnt_large_stash > 0) {
+        void * ptr = cache->large_stash[--cache->cnt_large_stash];
+
+        if (cache->dtor != nullptr)
+            cache->dtor(ptr);
+        free_slab(ptr);
+    }
+}
+
+
+/***********************
+ * Thread heaps        *
+ *                     *
+ ***********************/
+
+static void heap_slot_flush(thread_heap_slot * slot);
+static void heap_thread_exit(void * arg) {
+    (void) arg;
+    thread_slots_flush(tls_heaps, heap_slot_flush);
+}
+static void heap_init() {
+    cache_setup(&heap_cache, sizeof(thread_heap), 0, CACHE_NO_MAGAZINES, nullptr, nullptr);
+    pthread_key_create(&heap_key, heap_thread_exit);
+}
+/**
+ * It gives slab of heap back into lists of cache.
+ * heap->mtx must be held, cache->mtx is taken
+ **/
+static void heap_release_slab(struct cache *cache, thread_heap * heap, meta_block * meta) {
+    slab_list_unlink(meta->cnt_objects == 0 ? &heap->busy_slabs : &heap->partial_slabs, meta);
+    heap->cnt_capacity -= cache->cnt_objects;
+    heap->cnt_used -= cache->cnt_objects - meta->cnt_objects;
+
+    pthread_lock_quard lock(cache->mtx);
+    __atomic_store_n(&meta->heap, nullptr, __ATOMIC_RELAXED);
+
+    if (meta->cnt_objects == 0)
+        slab_push(cache, meta, SlabType::BUSY);
+    else if (meta->cnt_objects == cache->cnt_objects)
+        slab_push(cache, meta, SlabType::FREE);
+    else
+        slab_push(cache, meta, SlabType::PARTBUSY);
+}
+/**
+ * It takes slab from lists of cache (partially busy first),
+ * otherwise new slab is set up without cache lock.
+ * heap->mtx must be held
+ **/
+static bool heap_refill(struct cache *cache, thread_heap * heap) {
+    pthread_lock_quard lock(cache->mtx);
+    meta_block * meta = nullptr;
+
+    if (slab_partbusy_first(cache) != nullptr)
+        meta = slab_pop(cache, SlabType::PARTBUSY);
+    else if (cache->free_list_slabs != nullptr)
+        meta = slab_pop(cache, SlabType::FREE);
+
+    if (meta != nullptr)
+        __atomic_store_n(&meta->heap, heap, __ATOMIC_RELAXED);
+    lock.manual_unlock();
+
+    if (meta == nullptr) {
+        // new slab is not seen by other threads yet
+        meta = slab_setup(cache);
+        if (meta == nullptr)
+            return false;
+        __atomic_store_n(&meta->heap, heap, __ATOMIC_RELAXED);
+    }
+
+    slab_list_push(&heap->partial_slabs, meta);
+    heap->cnt_capacity += cache->cnt_objects;
+    heap->cnt_used += cache->cnt_objects - meta->cnt_objects;
+    return true;
+}
+/**
+ * It allocates object from slabs of heap. heap->mtx must be held
+ **/
+static void * heap_alloc(struct cache *cache, thread_heap * heap) {
+    if (heap->partial_slabs == nullptr && !heap_refill(cache, heap))
+        return nullptr;
+
+    meta_block * meta = heap->partial_slabs;
+    void * ptr = slab_take(cache, meta);
+    heap->cnt_used++;
+
+    if (meta->cnt_objects == 0) {
+        slab_list_unlink(&heap->partial_slabs, meta);
+        slab_list_push(&heap->busy_slabs, meta);
+    }
+    return ptr;
+}
+/**
+ * It frees object into slab of heap, then it keeps emptiness
+ * invariant of Hoard: if heap is too empty, a slab, which is at
+ * least 1/4 empty, migrates into cache. heap->mtx must be held
+ **/
+static void heap_free(struct cache *cache, thread_heap * heap, meta_block * meta, void *ptr) {
+    data_block * dblock = object_link(cache, ptr);
+    dblock->next = meta->head;
+    meta->head = dblock;
+
+    if (meta->cnt_objects++ == 0) {
+        slab_list_unlink(&heap->busy_slabs, meta);
+        slab_list_push(&heap->partial_slabs, meta);
+    }
+    heap->cnt_used--;
+
+    if (heap->cnt_used + HEAP_EMPTY_SLABS * cache->cnt_objects >= heap->cnt_capacity ||
+        heap->cnt_used * HEAP_EMPTY_FRACTION >= heap->cnt_capacity * (HEAP_EMPTY_FRACTION - 1))
+        return;
+
+    if (meta->cnt_objects * HEAP_EMPTY_FRACTION < cache->cnt_objects) {
+        meta = heap->partial_slabs;
+        while (meta != nullptr && meta->cnt_objects * HEAP_EMPTY_FRACTION < cache->cnt_objects)
+            meta = meta->next;
+    }
+
+    if (meta != nullptr)
+        heap_release_slab(cache, heap, meta);
+}
+/**
+ * It finds heap of cache without thread or makes new one
+ **/
+static thread_heap * heap_attach(struct cache *cache) {
+    pthread_lock_quard lock(cache->mtx);
+    thread_heap * heap = cache->heaps;
+
+    while (heap != nullptr && heap->attached)
+        heap = heap->next;
+
+    if (heap == nullptr) {
+        heap = (thread_heap *)cache_alloc(&heap_cache);
+        if (heap == nullptr)
+            return nullptr;
+
+        pthread_mutex_init(&heap->mtx, NULL);
+        heap->partial_slabs = nullptr;
+        heap->busy_slabs = nullptr;
+        heap->cnt_used = 0;
+        heap->cnt_capacity = 0;
+        heap->next = cache->heaps;
+        cache->heaps = heap;
+    }
+
+    heap->attached = true;
+    return heap;
+}
+/**
+ * It gives all slabs of heap back into cache and leaves heap
+ * for other thread. Heaps are not freed till cache_release,
+ * so other threads may still lock it and see, that slab moved
+ **/
+static void heap_detach(struct cache *cache, thread_heap * heap) {
+    pthread_lock_quard heap_lock(heap->mtx);
+
+    while (heap->partial_slabs != nullptr)
+        heap_release_slab(cache, heap, heap->partial_slabs);
+    while (heap->busy_slabs != nullptr)
+        heap_release_slab(cache, heap, heap->busy_slabs);
+
+    pthread_lock_quard lock(cache->mtx);
+    heap->attached = false;
+}
+static void heap_slot_flush(thread_heap_slot * slot) {
+    if (slot->cache_id == 0)
+        return;
+
+    pthread_lock_quard registry_lock(REGISTRY_MTX);
+    cache * owner = registry_find(slot->owner, slot->cache_id);
+
+    // heap of released cache is released together with it
+    if (owner != nullptr)
+        heap_detach(owner, slot->heap);
+
+    *slot = {0, nullptr, nullptr};
+}
+static thread_heap * heap_slot(struct cache *cache) {
+    thread_heap_slot * slot = thread_slot_of(cache, tls_heaps, &tls_heaps_registered,
+                                             heap_key, heap_slot_flush);
+    if (slot->cache_id == cache->id)
+        return slot->heap;
+
+    slot->heap = heap_attach(cache);
+    if (slot->heap != nullptr) {
+        slot->cache_id = cache->id;
+        slot->owner = cache;
+    }
+    return slot->heap;
+}
+static void * heap_cache_alloc(struct cache *cache) {
+    thread_heap * heap = heap_slot(cache);
+    if (heap == nullptr)
+        return nullptr;
+
+    pthread_lock_quard lock(heap->mtx);
+    return heap_alloc(cache, heap);
+}
+/**
+ * It frees object into heap, that owns its slab, or into cache.
+ * Owner is checked again under the lock, slab may migrate before
+ **/
+static void heap_cache_free(struct cache *cache, void *ptr) {
+    meta_block * meta = slab_meta_of(cache, ptr);
+
+    for (;;) {
+        thread_heap * heap = __atomic_load_n(&meta->heap, __ATOMIC_ACQUIRE);
+
+        if (heap == nullptr) {
+            pthread_lock_quard lock(cache->mtx);
+            if (__atomic_load_n(&meta->heap, __ATOMIC_RELAXED) != nullptr)
+                continue;
+
+            slab_object_free(cache, ptr);
+            return;
+        }
+
+        pthread_lock_quard lock(heap->mtx);
+        if (__atomic_load_n(&meta->heap, __ATOMIC_RELAXED) != heap)
+            continue;
+
+        heap_free(cache, heap, meta, ptr);
+        return;
+    }
+}
+
+
+/***********************
+ *          API        *
+ *                     *
+ ***********************/
+
+/**
+ * It first initialize struct cache per O(1).
+ * cache must be valid pointer on exist structure
+ *
+ * \param cache - structure, which need initialize
+ * \object_size - size which you want allocate (must be > 0)
+ * \flags - CACHE_NO_MAGAZINES disables per-thread magazines,
+ * CACHE_PERCPU replaces them by per-CPU slots (rseq), if the
+ * kernel supports it, otherwise the cache works under its lock,
+ * CACHE_LOCKFREE_FREE replaces them by lock-free push of cache_free
+ * into the slab, slabs are moved between lists by next locked alloc,
+ * CACHE_THREAD_HEAPS - by per-thread heaps, that own slabs (Hoard)
+ * \ctor, dtor - optional, ctor is called once for object before
+ * its first allocation, dtor - when its slab is released (by
+ * cache_shrink or cache_release). Freed objects must be returned
+ * in constructed state, then cache_alloc gives them as is
+ **/
+extern "C" void cache_setup(struct cache *cache, size_t object_size, int slab_order = 10,
+                            int flags = 0, void (*ctor)(void *) = nullptr,
+                            void (*dtor)(void *) = nullptr) {
+    assert(cache != nullptr && object_size > 0);
+
+    pthread_mutex_init(&cache->mtx, NULL);
+    cache->ctor = ctor;
+    cache->dtor = dtor;
+
+    // link of free list must not overwrite constructed fields
+    const bool constructed = ctor != nullptr || dtor != nullptr;
+    cache->link_offset  = cache_link_offset_of(object_size, constructed);
+    cache->object_size  = cache_object_size_of(object_size, constructed);
+    cache->slab_order   = slab_order;
+    cache->cnt_objects  = cache_cnt_objects_of(cache->object_size, slab_order);
+    cache->meta_block_offset = cache_meta_block_offset_of(slab_order);
+    cache->large_order  = -1;
+    cache->cnt_large_stash = 0;
+
+    // large objects take own pages, slab_order is not used. Stash
+    // keeps bare pointers, so they have no link of free list
+    if (object_round_up(object_size) > CACHE_LARGE_SIZE) {
+        cache->link_offset = 0;
+        cache->object_size = object_round_up(object_size);
+        cache->large_order = 0;
+        while ((PAGE_SIZE << cache->large_order) < cache->object_size)
+            cache->large_order++;
+        assert(cache->large_order <= BUDDY_MAX_ORDER);
+        flags = CACHE_NO_MAGAZINES;
+    }
+    assert(cache->large_order >= 0 || cache->cnt_objects > 0);
+
+    // lock-free free replaces magazines and per-CPU slots
+    cache->lockfree_free = cache->large_order < 0 && (flags & CACHE_LOCKFREE_FREE);
+    cache->pending_slabs = nullptr;
+    if (cache->lockfree_free)
+        flags = CACHE_NO_MAGAZINES;
+
+    // thread heaps replace magazines and per-CPU slots too
+    cache->thread_heaps = cache->large_order < 0 && !cache->lockfree_free &&
+                          (flags & CACHE_THREAD_HEAPS);
+    cache->heaps = nullptr;
+    if (cache->thread_heaps) {
+        flags = CACHE_NO_MAGAZINES;
+        pthread_once(&heap_once, heap_init);
+    }
+
+    cache->free_list_slabs = cache->large_order < 0 ? slab_setup(cache) : nullptr;
+    cache->busy_list_slabs = nullptr;
+    for (int i = 0; i < CNT_PARTBUSY_BINS; i++)
+        cache->partbusy_list_slabs[i] = nullptr;
+
+    cache->id = 0;
+    cache->magazine_size = (flags & CACHE_NO_MAGAZINES) ? 0 : magazine_size_for(cache->object_size);
+    cache->depot_full_magazines = nullptr;
+    cache->depot_empty_magazines = nullptr;
+    cache->depot_cnt_full = 0;
+    cache->depot_cnt_empty = 0;
+    cache->registry_next = nullptr;
+    cache->percpu_slots = nullptr;
+    cache->percpu_order = 0;
+
+    if (flags & CACHE_PERCPU) {
+        cache->magazine_size = 0;
+        pthread_once(&percpu_once, percpu_init);
+
+        if (percpu_available) {
+            size_t size = percpu_cnt_cpus * sizeof(percpu_slot);
+
+            while ((PAGE_SIZE << cache->percpu_order) < size)
+                cache->percpu_order++;
+
+            // nullptr - the cache works under lock
+            cache->percpu_slots = (percpu_slot *)alloc_slab(cache->percpu_order);
+            if (cache->percpu_slots != nullptr)
+                memset((void *)cache->percpu_slots, 0, PAGE_SIZE << cache->percpu_order);
+        }
+    }
+
+    if (cache->magazine_size != 0 || cache->thread_heaps) {
+        if (cache->magazine_size != 0)
+            pthread_once(&magazine_once, magazine_init);
+
+        pthread_lock_quard registry_lock(REGISTRY_MTX);
+        cache->id = ++cache_last_id;
+        cache->tls_slot = registry_free_slot(cache->id);
+        cache->registry_next = cache_registry;
+        cache_registry = cache;
+    }
+}
+/**
+ * It deallocates all slabs (by free_slab)
+ * and fill struct cache by zero per O(K),
+ * K - count of slabs.
+ * cache must be valid structure, otherwise undefined behavior
+ **/
+extern "C" void cache_release(struct cache *cache) {
+    assert(cache != nullptr);
+
+    if (cache->magazine_size != 0 || cache->thread_heaps) {
+        pthread_lock_quard registry_lock(REGISTRY_MTX);
+        struct cache ** link = &cache_registry;
+
+        while (*link != cache)
+            link = &(*link)->registry_next;
+        *link = cache->registry_next;
+    }
+
+    pthread_lock_quard lock(cache->mtx);
+
+    // objects of magazines die together with slabs, magazines of
+    // other threads are deleted by them on next flush of the slot
+    if (cache->magazine_size != 0) {
+        thread_magazines * slot = &tls_magazines[cache->tls_slot];
+
+        if (slot->cache_id == cache->id) {
+            magazine_delete(slot->loaded);
+            magazine_delete(slot->previous);
+            *slot = {0, nullptr, nullptr, nullptr};
+        }
+        depot_release(cache, false);
+    }
+
+    if (cache->percpu_slots != nullptr)
+        free_slab(cache->percpu_slots);
+
+    // slabs of heaps die together with heaps, heaps of other
+    // threads are forgotten by them on next flush of the slot
+    if (cache->thread_heaps) {
+        thread_heap_slot * slot = &tls_heaps[cache->tls_slot];
+
+        if (slot->cache_id == cache->id)
+            *slot = {0, nullptr, nullptr};
+
+        while (cache->heaps != nullptr) {
+            thread_heap * heap = cache->heaps;
+            cache->heaps = heap->next;
+
+            list_slabs_release(cache, heap->partial_slabs);
+            list_slabs_release(cache, heap->busy_slabs);
+            pthread_mutex_destroy(&heap->mtx);
+            cache_free(&heap_cache, heap);
+        }
+    }
+    // large objects, which are still allocated, are not known
+    // to cache, they may be freed by slab_kfree later
+    large_stash_release(cache);
+
+    list_slabs_release(cache, cache->free_list_slabs);
+    list_slabs_release(cache, cache->busy_list_slabs);
+    for (int i = 0; i < CNT_PARTBUSY_BINS; i++)
+        list_slabs_release(cache, cache->partbusy_list_slabs[i]);
+
+    cache->object_size          = 0;
+    cache->slab_order           = 0;
+    cache->cnt_objects          = 0;
+    cache->meta_block_offset    = 0;
+    cache->free_list_slabs      = nullptr;
+    cache->busy_list_slabs      = nullptr;
+    for (int i = 0; i < CNT_PARTBUSY_BINS; i++)
+        cache->partbusy_list_slabs[i] = nullptr;
+    cache->id                   = 0;
+    cache->tls_slot             = 0;
+    cache->magazine_size        = 0;
+    cache->registry_next        = nullptr;
+    cache->percpu_slots         = nullptr;
+    cache->ctor                 = nullptr;
+    cache->dtor                 = nullptr;
+    cache->link_offset          = 0;
+    cache->large_order          = -1;
+    cache->remote_free          = nullptr;
+    cache->lockfree_free        = false;
+    cache->pending_slabs        = nullptr;
+    cache->thread_heaps         = false;
+
+    lock.manual_unlock();
+    pthread_mutex_destroy(&cache->mtx);
+}
+/**
+ * It allocate one block of memory >= object_size per O(1).
+ * cache must be valid structure, otherwise undefined behavior.
+ *
+ * \return pointer to memory
+ **/
+extern "C" void *cache_alloc(struct cache *cache) {
+    assert(cache != nullptr);
+
+    if (cache->magazine_size != 0)
+        return magazine_alloc(cache);
+    if (cache->large_order >= 0)
+        return large_alloc(cache);
+    if (cache->thread_heaps)
+        return heap_cache_alloc(cache);
+    if (cache->percpu_slots != nullptr)
+        return percpu_alloc(cache);
+
+    pthread_lock_quard lock(cache->mtx);
+    slab_remote_drain(cache);
+    slab_pending_drain(cache);
+    void * ptr = slab_object_alloc(cache);
+
+    if (ptr != nullptr)
+        return ptr;
+    lock.manual_unlock();
+
+    // new slab is set up without lock and its first object goes to
+    // the caller, so other threads can not take it away
+    meta_block * meta = slab_setup(cache);
+    if (meta == nullptr)
+        return nullptr;
+
+    ptr = slab_take(cache, meta);
+
+    pthread_lock_quard push_lock(cache->mtx);
+    slab_push(cache, meta, meta->cnt_objects == 0 ? SlabType::BUSY : SlabType::PARTBUSY);
+    return ptr;
+}
+/**
+ * It allocates cnt objects into ptrs under one lock of cache,
+ * whole runs of free objects are taken from slabs per O(cnt)
+ * like kmem_cache_alloc_bulk. Magazines and per-CPU slots are
+ * bypassed, objects may be freed by cache_free later.
+ *
+ * \return cnt or 0, if no memory (then nothing is allocated)
+ **/
+extern "C" size_t cache_alloc_bulk(struct cache *cache, size_t cnt, void **ptrs) {
+    assert(cache != nullptr && ptrs != nullptr);
+
+    if (cache->large_order >= 0) {
+        for (size_t i = 0; i < cnt; i++) {
+            ptrs[i] = large_alloc(cache);
+
+            if (ptrs[i] == nullptr) {
+                while (i > 0)
+                    large_free(cache, ptrs[--i]);
+                return 0;
+            }
+        }
+        return cnt;
+    }
+
+    pthread_lock_quard lock(cache->mtx);
+    slab_remote_drain(cache);
+    slab_pending_drain(cache);
+    size_t allocated = slab_objects_alloc(cache, ptrs, cnt);
+
+    if (allocated == cnt)
+        return cnt;
+
+    slab_objects_free(cache, ptrs, allocated);
+    return 0;
+}
+/**
+ * It come back cnt objects under one lock of cache per
+ * O(cnt * log(cnt)): ptrs is sorted, so objects of one slab are
+ * spliced into it at once and every slab is moved between lists
+ * at most once. Magazines and per-CPU slots are bypassed.
+ * Contents of ptrs are replaced by nullptr.
+ *
+ * \param ptrs - pointers from cache_alloc or cache_alloc_bulk
+ **/
+extern "C" void cache_free_bulk(struct cache *cache, size_t cnt, void **ptrs) {
+    assert(cache != nullptr && ptrs != nullptr);
+
+    if (cache->large_order >= 0 || cache->thread_heaps) {
+        for (size_t i = 0; i < cnt; i++) {
+            if (ptrs[i] != nullptr)
+                cache_free(cache, ptrs[i]);
+            ptrs[i] = nullptr;
+        }
+        return;
+    }
+
+    pthread_lock_quard lock(cache->mtx);
+    slab_objects_free(cache, ptrs, cnt);
+}
+/**
+ * It come back one block into slab per O(1).
+ * If other thread holds the lock, block is pushed into
+ * remote free list of cache without waiting
+ *
+ * \param ptr - pointer to allocated memory before.
+ * If is not valid pointer - undefined behavior
+ **/
+extern "C" void cache_free(struct cache *cache, void *ptr) {
+    if (cache->magazine_size != 0) {
+        magazine_free(cache, ptr);
+        return;
+    }
+    if (cache->percpu_slots != nullptr) {
+        percpu_free(cache, ptr);
+        return;
+    }
+    if (cache->large_order >= 0) {
+        large_free(cache, ptr);
+        return;
+    }
+
+    if (cache->lockfree_free) {
+        slab_lockfree_push(cache, ptr);
+        return;
+    }
+    if (cache->thread_heaps) {
+        heap_cache_free(cache, ptr);
+        return;
+    }
+
+    // other thread holds the lock: do not wait for it
+    if (pthread_mutex_trylock(&cache->mtx) != 0) {
+        slab_remote_push(cache, ptr);
+        return;
+    }
+
+    slab_object_free(cache, ptr);
+    pthread_mutex_unlock(&cache->mtx);
+}
+/**
+ * It release all free slabs, if such exist.
+ * Magazines of depot and of the current thread
+ * and per-CPU slots are returned into slabs before
+ **/
 extern "C" void cache_shrink(struct cache *cache) {
-    pthread_lock_quard lock(MTX);
+    if (cache->magazine_size != 0) {
+        thread_magazines * slot = &tls_magazines[cache->tls_slot];
+
+        if (slot->cache_id == cache->id)
+            magazine_slot_flush(slot);
+    }
+    if (cache->thread_heaps) {
+        thread_heap_slot * slot = &tls_heaps[cache->tls_slot];
+
+        if (slot->cache_id == cache->id)
+            heap_slot_flush(slot);
+    }
+
+    pthread_lock_quard lock(cache->mtx);
+
+    if (cache->magazine_size != 0)
+        depot_release(cache, true);
+    if (cache->percpu_slots != nullptr)
+        percpu_drain(cache);
+    large_stash_release(cache);
+    slab_remote_drain(cache);
+    slab_pending_drain(cache);
+
+    list_slabs_release(cache, cache->free_list_slabs);
+    cache->free_list_slabs = nullptr;
+}
+
+
+
+
+/***********************
+ * General purpose     *
+ * allocator (kmalloc) *
+ *                     *
+ ***********************/
+
+// Size classes: 8, 16, 24, 32, then 4 classes per each
+// power of 2 (40, 48, 56, 64, 80, ...) up to KMALLOC_MAX_SIZE.
+// Bigger requests take pages of buddy allocator directly
+static const size_t KMALLOC_MAX_SIZE = 32 * (1 << 10); // 32 KiB
+static const int KMALLOC_CNT_CLASSES = 44;
+// Slab order of all size classes
+static const int KMALLOC_SLAB_ORDER = 6; // 256 KiB
+
+static struct cache kmalloc_caches[KMALLOC_CNT_CLASSES];
+static pthread_once_t kmalloc_once = PTHREAD_ONCE_INIT;
+
+static int kmalloc_index(size_t size) {
+    if (size <= 32)
+        return size <= 8 ? 0 : (int)((size + 7) / 8) - 1;
+
+    const int lg = 63 - __builtin_clzll(size - 1);
+    const size_t step = ((size_t)1 << lg) / 4;
+
+    return 4 + (lg - 5) * 4 + (int)((size - 1 - ((size_t)1 << lg)) / step);
+}
+static size_t kmalloc_size(int idx) {
+    if (idx < 4)
+        return 8 * (idx + 1);
+
+    const int lg = 5 + (idx - 4) / 4;
+    return ((size_t)1 << lg) + (size_t)((idx - 4) % 4 + 1) * (((size_t)1 << lg) / 4);
+}
+static void kmalloc_init() {
+    for (int i = 0; i < KMALLOC_CNT_CLASSES; i++)
+        cache_setup(&kmalloc_caches[i], kmalloc_size(i), KMALLOC_SLAB_ORDER);
+}
+/**
+ * \return order of pages for big allocation or -1, if it is too big
+ **/
+static int kmalloc_pages_order(size_t size) {
+    int order = 0;
+
+    while (order <= BUDDY_MAX_ORDER && (PAGE_SIZE << order) < size)
+        order++;
+    return order <= BUDDY_MAX_ORDER ? order : -1;
+}
+/**
+ * It allocates memory of any size per O(1*). Sizes up to
+ * KMALLOC_MAX_SIZE are served by caches of size classes,
+ * bigger sizes - by pages (up to 1 GiB)
+ *
+ * \return pointer to memory or nullptr
+ **/
+extern "C" void *slab_malloc(size_t size) {
+    pthread_once(&kmalloc_once, kmalloc_init);
+
+    if (size <= KMALLOC_MAX_SIZE)
+        return cache_alloc(&kmalloc_caches[kmalloc_index(size)]);
+
+    int order = kmalloc_pages_order(size);
+    return order >= 0 ? alloc_slab(order) : nullptr;
+}
+/**
+ * It frees object of any cache or memory of slab_malloc
+ * by pointer only per O(1): the slab is found by marks of buddy
+ * pages and its meta_block keeps the owner cache
+ *
+ * \param ptr - pointer from cache_alloc, slab_malloc or nullptr
+ **/
+extern "C" void slab_kfree(void *ptr) {
+    if (ptr == nullptr)
+        return;
+
+    void * block = nullptr;
+    uint8_t mark = buddy_block_of(ptr, &block);
+
+    if (!(mark & BUDDY_SLAB)) {
+        assert(block == ptr);
+        struct cache * owner = *buddy_alloc_owner(block);
+
+        // large object comes back into its cache (stash, dtor)
+        if (owner != nullptr)
+            cache_free(owner, ptr);
+        else
+            free_slab(ptr);
+        return;
+    }
+
+    const int order = (mark & ~BUDDY_SLAB) - 1;
+    meta_block * meta = (meta_block *)((uint8_t *)block + cache_meta_block_offset_of(order));
+
+    cache_free(meta->owner, ptr);
+}
+/**
+ * It frees memory, that has been allocated by slab_malloc
+ *
+ * \param ptr - pointer from slab_malloc or nullptr
+ **/
+extern "C" void slab_free(void *ptr) {
+    slab_kfree(ptr);
+}
+
+
+
+
+/***********************
+ * Typed front-end     *
+ * slab_cache<T>       *
+ *                     *
+ ***********************/
+
+/**
+ * It checks, that objects of cache come back into their slabs
+ * under cache->mtx only (no magazines, per-CPU slots, large objects,
+ * lock-free free or thread heaps), so slab_splice may be used directly
+ **/
+static inline bool cache_is_plain(struct cache const *cache) {
+    return cache->magazine_size == 0 && cache->percpu_slots == nullptr &&
+           cache->large_order < 0 && !cache->lockfree_free && !cache->thread_heaps;
+}
+/**
+ * Cache of objects of type T. Geometry of its slabs is known at
+ * compile time, so destroy finds meta_block of object by constant
+ * mask and offset. Objects are constructed by create (placement-new)
+ * and destroyed by destroy, T must not be over-aligned.
+ **/
+template <typename T, int Order = 10>
+class slab_cache {
+public:
+    static constexpr size_t object_size       = cache_object_size_of(sizeof(T), false);
+    static constexpr size_t slab_size         = slab_size_of(Order);
+    static constexpr size_t meta_block_offset = cache_meta_block_offset_of(Order);
+    static constexpr size_t cnt_objects       = cache_cnt_objects_of(object_size, Order);
+
+    static_assert(alignof(T) <= OBJECT_ALIGN, "over-aligned types are not supported");
+    static_assert(Order >= 0 && Order <= BUDDY_MAX_ORDER, "slab order is out of range");
+    static_assert(cnt_objects > 0, "object does not fit in slab");
+
+    explicit slab_cache(int flags = 0) {
+        cache_setup(&cache_, sizeof(T), Order, flags);
+        assert(cache_.object_size == object_size && cache_.cnt_objects == cnt_objects);
+        assert(cache_.meta_block_offset == meta_block_offset);
+    }
+    ~slab_cache() {
+        cache_release(&cache_);
+    }
+    slab_cache(const slab_cache &) = delete;
+    slab_cache & operator=(const slab_cache &) = delete;
+
+    /**
+     * It allocates object and constructs it by args
+     *
+     * \return pointer to object or nullptr, if no memory
+     **/
+    template <typename... Args>
+    T * create(Args &&... args) {
+        void * ptr = cache_alloc(&cache_);
+        if (ptr == nullptr)
+            return nullptr;
+
+        try {
+            return new (ptr) T(std::forward<Args>(args)...);
+        } catch (...) {
+            cache_free(&cache_, ptr);
+            throw;
+        }
+    }
+    /**
+     * It destroys object and come back it into cache
+     *
+     * \param ptr - pointer from create or nullptr
+     **/
+    void destroy(T * ptr) {
+        if (ptr == nullptr)
+            return;
+
+        ptr->~T();
+        if (!cache_is_plain(&cache_)) {
+            cache_free(&cache_, ptr);
+            return;
+        }
+
+        meta_block * meta = (meta_block *)(((size_t)ptr & ~(slab_size - 1)) + meta_block_offset);
+        data_block * dblock = (data_block *)ptr;
+
+        pthread_lock_quard lock(cache_.mtx);
+        slab_splice(&cache_, meta, dblock, dblock, 1);
+    }
+    void shrink() {
+        cache_shrink(&cache_);
+    }
+    struct cache * raw() {
+        return &cache_;
+    }
+
+private:
+    struct cache cache_;
+};
+
+
+
+
+/***********************
+ * std::pmr adapter    *
+ *                     *
+ ***********************/
+
+/**
+ * \return index of size class, which objects are aligned on
+ * alignment, or -1, if request must be served by pages
+ **/
+static int kmalloc_index_aligned(size_t size, size_t alignment) {
+    if (size < alignment)
+        size = alignment;
+    if (size > KMALLOC_MAX_SIZE)
+        return -1;
+
+    // objects of class lie in a row from start of slab, so
+    // they are aligned on the lowest set bit of class size
+    int idx = kmalloc_index(size);
+    while (idx < KMALLOC_CNT_CLASSES && (kmalloc_size(idx) & (alignment - 1)) != 0)
+        idx++;
+    return idx < KMALLOC_CNT_CLASSES ? idx : -1;
+}
+/**
+ * It allocates memory of size aligned on alignment (power of 2)
+ * from size classes or pages
+ *
+ * \return pointer to memory or nullptr
+ **/
+static void * kmalloc_aligned(size_t size, size_t alignment) {
+    pthread_once(&kmalloc_once, kmalloc_init);
 
-    list_slabs_release(cache->free_list_slabs, cache->meta_block_offset);
-    cache->free_list_slabs = nullptr;
+    int idx = kmalloc_index_aligned(size, alignment);
+    if (idx >= 0)
+        return cache_alloc(&kmalloc_caches[idx]);
+
+    int order = kmalloc_pages_order(size > alignment ? size : alignment);
+    return order >= 0 ? alloc_slab(order) : nullptr;
+}
+/**
+ * It frees memory of kmalloc_aligned by its size and alignment:
+ * the cache is selected directly, without lookup of buddy pages
+ **/
+static void kfree_sized(void * ptr, size_t size, size_t alignment) {
+    int idx = kmalloc_index_aligned(size, alignment);
+
+    if (idx >= 0)
+        cache_free(&kmalloc_caches[idx], ptr);
+    else
+        free_slab(ptr);
+}
+/**
+ * \return alignment of malloc and operator new: 16 (max_align_t),
+ * smaller objects can not hold such types, so 8 is enough for them
+ **/
+[[maybe_unused]] static size_t kmalloc_default_align(size_t size) {
+    return size >= 2 * OBJECT_ALIGN ? 2 * OBJECT_ALIGN : OBJECT_ALIGN;
+}
+/**
+ * Memory resource for std::pmr containers over size classes of
+ * slab_malloc. Size and alignment of deallocation select the cache
+ * directly, so pages of buddy allocator are not looked up.
+ * All instances share the same caches and are equal
+ **/
+class slab_memory_resource : public std::pmr::memory_resource {
+protected:
+    void * do_allocate(size_t bytes, size_t alignment) override {
+        void * ptr = kmalloc_aligned(bytes, alignment);
+        if (ptr == nullptr)
+            throw std::bad_alloc();
+        return ptr;
+    }
+    void do_deallocate(void * ptr, size_t bytes, size_t alignment) override {
+        kfree_sized(ptr, bytes, alignment);
+    }
+    bool do_is_equal(const std::pmr::memory_resource & other) const noexcept override {
+        return dynamic_cast<const slab_memory_resource *>(&other) != nullptr;
+    }
+};
+/**
+ * \return memory resource over slab caches, it lives forever
+ **/
+static std::pmr::memory_resource * slab_resource() {
+    static slab_memory_resource resource;
+    return &resource;
+}
+
+
+
+
+/***********************
+ * Node allocator      *
+ * for STL containers  *
+ *                     *
+ ***********************/
+
+// Nodes up to NODE_MAX_SIZE get a cache of their exact (rounded)
+// size, one per size and shared by all containers and types
+static const size_t NODE_MAX_SIZE = 512;
+static const int NODE_CNT_CACHES = NODE_MAX_SIZE / OBJECT_ALIGN + 1;
+
+static pthread_mutex_t NODE_MTX = PTHREAD_MUTEX_INITIALIZER;
+static struct cache node_caches[NODE_CNT_CACHES];
+static bool node_cache_ready[NODE_CNT_CACHES];
+
+/**
+ * \return cache of objects of size, it is set up by first call
+ **/
+static struct cache * node_cache_of(size_t size) {
+    const size_t idx = cache_object_size_of(size, false) / OBJECT_ALIGN;
+    assert(idx < NODE_CNT_CACHES);
+
+    if (!__atomic_load_n(&node_cache_ready[idx], __ATOMIC_ACQUIRE)) {
+        pthread_lock_quard lock(NODE_MTX);
+
+        if (!node_cache_ready[idx]) {
+            cache_setup(&node_caches[idx], idx * OBJECT_ALIGN, KMALLOC_SLAB_ORDER);
+            __atomic_store_n(&node_cache_ready[idx], true, __ATOMIC_RELEASE);
+        }
+    }
+
+    return &node_caches[idx];
+}
+/**
+ * It release free slabs of all node caches
+ **/
+[[maybe_unused]] static void slab_node_shrink() {
+    for (int i = 0; i < NODE_CNT_CACHES; i++)
+        if (__atomic_load_n(&node_cache_ready[i], __ATOMIC_ACQUIRE))
+            cache_shrink(&node_caches[i]);
+}
+/**
+ * Allocator for node-based containers (std::map, std::list,
+ * std::unordered_map). Containers rebind it to their node type,
+ * and single nodes come from the cache of node size. Arrays
+ * (like bucket arrays) and big or over-aligned types go to
+ * the general path (slab_resource)
+ **/
+template <typename T>
+class slab_node_allocator {
+public:
+    using value_type = T;
+    using is_always_equal = std::true_type;
+
+    slab_node_allocator() noexcept = default;
+    template <typename U>
+    slab_node_allocator(const slab_node_allocator<U> &) noexcept {}
+
+    T * allocate(size_t n) {
+        if (is_node(n)) {
+            void * ptr = cache_alloc(node_cache_of(sizeof(T)));
+            if (ptr == nullptr)
+                throw std::bad_alloc();
+            return (T *)ptr;
+        }
+
+        if (n > SIZE_MAX / sizeof(T))
+            throw std::bad_array_new_length();
+        return (T *)slab_resource()->allocate(n * sizeof(T), alignof(T));
+    }
+    void deallocate(T * ptr, size_t n) noexcept {
+        if (is_node(n))
+            cache_free(node_cache_of(sizeof(T)), ptr);
+        else
+            slab_resource()->deallocate(ptr, n * sizeof(T), alignof(T));
+    }
+
+private:
+    static constexpr bool is_node(size_t n) {
+        return n == 1 && sizeof(T) <= NODE_MAX_SIZE && alignof(T) <= OBJECT_ALIGN;
+    }
+};
+template <typename T, typename U>
+bool operator==(const slab_node_allocator<T> &, const slab_node_allocator<U> &) noexcept {
+    return true;
+}
+template <typename T, typename U>
+bool operator!=(const slab_node_allocator<T> &, const slab_node_allocator<U> &) noexcept {
+    return false;
+}
+
+
+
+
+/***********************
+ * operator new/delete *
+ * (opt-in)            *
+ *                     *
+ ***********************/
+#ifdef SLAB_OPERATOR_NEW
+
+static void * operator_new(size_t size, size_t alignment) {
+    for (;;) {
+        void * ptr = kmalloc_aligned(size, alignment);
+        if (ptr != nullptr)
+            return ptr;
+
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr)
+            throw std::bad_alloc();
+        handler();
+    }
+}
+static void * operator_new_nothrow(size_t size, size_t alignment) noexcept {
+    try {
+        return operator_new(size, alignment);
+    } catch (...) {
+        return nullptr;
+    }
+}
+static size_t align_of(std::align_val_t alignment) {
+    return (size_t)alignment < OBJECT_ALIGN ? OBJECT_ALIGN : (size_t)alignment;
+}
+
+void * operator new(size_t size) {
+    return operator_new(size, kmalloc_default_align(size));
+}
+void * operator new[](size_t size) {
+    return operator_new(size, kmalloc_default_align(size));
+}
+void * operator new(size_t size, const std::nothrow_t &) noexcept {
+    return operator_new_nothrow(size, kmalloc_default_align(size));
+}
+void * operator new[](size_t size, const std::nothrow_t &) noexcept {
+    return operator_new_nothrow(size, kmalloc_default_align(size));
+}
+void * operator new(size_t size, std::align_val_t alignment) {
+    return operator_new(size, align_of(alignment));
+}
+void * operator new[](size_t size, std::align_val_t alignment) {
+    return operator_new(size, align_of(alignment));
+}
+void * operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return operator_new_nothrow(size, align_of(alignment));
+}
+void * operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return operator_new_nothrow(size, align_of(alignment));
+}
+
+// Unsized delete finds the cache by buddy pages (slab_kfree),
+// sized delete selects it by size class directly
+void operator delete(void * ptr) noexcept {
+    slab_kfree(ptr);
+}
+void operator delete[](void * ptr) noexcept {
+    slab_kfree(ptr);
+}
+void operator delete(void * ptr, const std::nothrow_t &) noexcept {
+    slab_kfree(ptr);
+}
+void operator delete[](void * ptr, const std::nothrow_t &) noexcept {
+    slab_kfree(ptr);
+}
+void operator delete(void * ptr, std::align_val_t) noexcept {
+    slab_kfree(ptr);
+}
+void operator delete[](void * ptr, std::align_val_t) noexcept {
+    slab_kfree(ptr);
+}
+void operator delete(void * ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+    slab_kfree(ptr);
+}
+void operator delete[](void * ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+    slab_kfree(ptr);
+}
+void operator delete(void * ptr, size_t size) noexcept {
+    if (ptr != nullptr)
+        kfree_sized(ptr, size, kmalloc_default_align(size));
+}
+void operator delete[](void * ptr, size_t size) noexcept {
+    if (ptr != nullptr)
+        kfree_sized(ptr, size, kmalloc_default_align(size));
+}
+void operator delete(void * ptr, size_t size, std::align_val_t alignment) noexcept {
+    if (ptr != nullptr)
+        kfree_sized(ptr, size, align_of(alignment));
+}
+void operator delete[](void * ptr, size_t size, std::align_val_t alignment) noexcept {
+    if (ptr != nullptr)
+        kfree_sized(ptr, size, align_of(alignment));
+}
+
+#endif // SLAB_OPERATOR_NEW
+
+
+
+/***********************
+ * malloc replacement  *
+ * (LD_PRELOAD)        *
+ *                     *
+ ***********************/
+#ifdef SLAB_PRELOAD
+
+// Memory for allocations, which are made while the allocator is busy
+// (it calls itself on the same thread) - it must never happen, but
+// libc may call malloc from anywhere during bootstrap. It is never freed,
+// size of allocation is kept in the word before it for realloc
+static const size_t PRELOAD_BOOT_SIZE = 64 * (1 << 10);
+alignas(64) static uint8_t preload_boot[PRELOAD_BOOT_SIZE];
+static size_t preload_boot_used = 0;
+static thread_local bool preload_busy = false;
+
+static void * preload_boot_alloc(size_t size, size_t alignment) {
+    size_t used = __atomic_load_n(&preload_boot_used, __ATOMIC_RELAXED);
+    size_t start = 0;
+
+    do {
+        start = (used + sizeof(size_t) + alignment - 1) & ~(alignment - 1);
+        if (start + size > PRELOAD_BOOT_SIZE || start + size < start)
+            return nullptr;
+    } while (!__atomic_compare_exchange_n(&preload_boot_used, &used, start + size, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    memcpy(preload_boot + start - sizeof(size_t), &size, sizeof(size_t));
+    return preload_boot + start;
+}
+static bool preload_is_boot(void * ptr) {
+    return (uint8_t *)ptr >= preload_boot && (uint8_t *)ptr < preload_boot + PRELOAD_BOOT_SIZE;
+}
+static size_t preload_boot_size(void * ptr) {
+    size_t size = 0;
+    memcpy(&size, (uint8_t *)ptr - sizeof(size_t), sizeof(size_t));
+    return size;
+}
+// The child of fork has only the thread, that called fork, so locks
+// held by other threads would never be unlocked there. All locks of
+// allocator are taken before fork (in lock order) and released after.
+// Caches without magazines and thread heaps are not in the registry,
+// their locks are not taken: malloc does not use such caches
+static pthread_once_t preload_fork_once = PTHREAD_ONCE_INIT;
+
+/**
+ * It locks all heaps of cache and then cache->mtx. New heaps are
+ * pushed at head of the list under cache->mtx, so it repeats
+ * while some heap is attached in between
+ **/
+static void preload_fork_lock_cache(struct cache *cache) {
+    thread_heap * locked = nullptr;
+
+    for (;;) {
+        pthread_mutex_lock(&cache->mtx);
+        thread_heap * head = cache->heaps;
+        if (head == locked)
+            return;
+        pthread_mutex_unlock(&cache->mtx);
+
+        for (thread_heap * heap = head; heap != locked; heap = heap->next)
+            pthread_mutex_lock(&heap->mtx);
+        locked = head;
+    }
+}
+/**
+ * It unlocks mutex in parent, in child it's initialized
+ * again: its owner thread does not exist there
+ **/
+static void preload_fork_unlock(pthread_mutex_t * mtx, bool in_child) {
+    if (in_child)
+        pthread_mutex_init(mtx, NULL);
+    else
+        pthread_mutex_unlock(mtx);
+}
+static void preload_fork_unlock_all(bool in_child) {
+    preload_fork_unlock(&PAGE_MTX, in_child);
+    preload_fork_unlock(&heap_cache.mtx, in_child);
+    preload_fork_unlock(&magazine_cache.mtx, in_child);
+
+    for (cache * owner = cache_registry; owner != nullptr; owner = owner->registry_next) {
+        for (thread_heap * heap = owner->heaps; heap != nullptr; heap = heap->next)
+            preload_fork_unlock(&heap->mtx, in_child);
+        preload_fork_unlock(&owner->mtx, in_child);
+    }
+
+    preload_fork_unlock(&REGISTRY_MTX, in_child);
+    preload_fork_unlock(&NODE_MTX, in_child);
+}
+static void preload_fork_prepare() {
+    pthread_mutex_lock(&NODE_MTX);
+    pthread_mutex_lock(&REGISTRY_MTX);
+
+    for (cache * owner = cache_registry; owner != nullptr; owner = owner->registry_next)
+        preload_fork_lock_cache(owner);
+
+    pthread_mutex_lock(&magazine_cache.mtx);
+    pthread_mutex_lock(&heap_cache.mtx);
+    pthread_mutex_lock(&PAGE_MTX);
+}
+static void preload_fork_parent() {
+    preload_fork_unlock_all(false);
+}
+static void preload_fork_child() {
+    preload_fork_unlock_all(true);
+}
+static void preload_fork_init() {
+    pthread_atfork(preload_fork_prepare, preload_fork_parent, preload_fork_child);
+}
+/**
+ * \param alignment - power of 2, at least OBJECT_ALIGN
+ * \return pointer to memory or nullptr with errno = ENOMEM
+ **/
+static void * preload_alloc(size_t size, size_t alignment) {
+    void * ptr = nullptr;
+
+    if (preload_busy) {
+        ptr = preload_boot_alloc(size, alignment);
+    } else {
+        preload_busy = true;
+        pthread_once(&preload_fork_once, preload_fork_init);
+        ptr = kmalloc_aligned(size, alignment);
+        preload_busy = false;
+    }
+
+    if (ptr == nullptr)
+        errno = ENOMEM;
+    return ptr;
+}
+/**
+ * \return size of memory of ptr, 0 - it is not ours
+ **/
+static size_t preload_usable_size(void * ptr) {
+    if (ptr != nullptr && preload_is_boot(ptr))
+        return preload_boot_size(ptr);
+    if (ptr == nullptr || buddy_arena_of(ptr) == nullptr)
+        return 0;
+
+    void * block = nullptr;
+    uint8_t mark = buddy_block_of(ptr, &block);
+
+    if (!(mark & BUDDY_SLAB))
+        return PAGE_SIZE << (mark - 1);
+
+    const int order = (mark & ~BUDDY_SLAB) - 1;
+    meta_block * meta = (meta_block *)((uint8_t *)block + cache_meta_block_offset_of(order));
+    return meta->owner->object_size;
+}
+
+extern "C" void * malloc(size_t size) noexcept {
+    return preload_alloc(size, kmalloc_default_align(size));
+}
+extern "C" void free(void * ptr) noexcept {
+    // memory of bootstrap and of other allocators is not returned
+    if (ptr == nullptr || preload_is_boot(ptr) || buddy_arena_of(ptr) == nullptr)
+        return;
+    slab_kfree(ptr);
+}
+extern "C" void * calloc(size_t cnt, size_t size) noexcept {
+    size_t total = 0;
+    if (__builtin_mul_overflow(cnt, size, &total)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+
+    // pages of buddy allocator are reused without zeroing
+    void * ptr = preload_alloc(total, kmalloc_default_align(total));
+    if (ptr != nullptr)
+        memset(ptr, 0, total);
+    return ptr;
+}
+extern "C" void * realloc(void * ptr, size_t size) noexcept {
+    if (ptr == nullptr)
+        return malloc(size);
+    if (size == 0) {
+        free(ptr);
+        return nullptr;
+    }
+
+    size_t old_size = preload_usable_size(ptr);
+    // shrinking in place, unless it wastes more than half.
+    // Memory of bootstrap is always copied out
+    if (!preload_is_boot(ptr) && size <= old_size && size >= old_size / 2)
+        return ptr;
+
+    void * new_ptr = malloc(size);
+    if (new_ptr == nullptr)
+        return nullptr;
+
+    memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+    free(ptr);
+    return new_ptr;
+}
+extern "C" int posix_memalign(void ** memptr, size_t alignment, size_t size) noexcept {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+
+    void * ptr = preload_alloc(size, alignment < OBJECT_ALIGN ? OBJECT_ALIGN : alignment);
+    if (ptr == nullptr)
+        return ENOMEM;
+
+    *memptr = ptr;
+    return 0;
+}
+extern "C" void * aligned_alloc(size_t alignment, size_t size) noexcept {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return preload_alloc(size, alignment < OBJECT_ALIGN ? OBJECT_ALIGN : alignment);
+}
+// old interfaces of glibc, they must not reach its malloc
+extern "C" void * memalign(size_t alignment, size_t size) noexcept {
+    return aligned_alloc(alignment, size);
+}
+extern "C" void * valloc(size_t size) noexcept {
+    return preload_alloc(size, PAGE_SIZE);
+}
+extern "C" size_t malloc_usable_size(void * ptr) noexcept {
+    return preload_usable_size(ptr);
 }
 
+#else
 
 
 
@@ -425,6 +3104,7 @@ extern "C" void cache_shrink(struct cache *cache) {
 
 static struct cache mycache_alloc;
 static const size_t object_size = (1 << 20); // 1 MiB
+static const size_t dump_object_size = 1000;
 
 extern "C" void * routine(void * arg) {
     (void) arg;
@@ -455,7 +3135,262 @@ extern "C" void * routine(void * arg) {
     return NULL;
 }
 
-int main() {
+static struct cache mysmallcache_alloc;
+static const size_t small_object_size = 48;
+static const size_t cnt_small_th = 4;
+static const size_t cnt_small = 1000;
+static void * small_ptrs[cnt_small_th][cnt_small];
+
+extern "C" void * small_alloc_routine(void * arg) {
+    const size_t idx = (size_t)arg;
+
+    for (size_t i = 0; i < cnt_small; i++) {
+        small_ptrs[idx][i] = cache_alloc(&mysmallcache_alloc);
+        assert(small_ptrs[idx][i] != nullptr);
+        memset(small_ptrs[idx][i], (int)idx + 1, small_object_size);
+    }
+
+    for (size_t i = 0; i < cnt_small; i++)
+        for (size_t j = 0; j < small_object_size; j++)
+            assert(((uint8_t *)small_ptrs[idx][i])[j] == idx + 1);
+
+    return NULL;
+}
+extern "C" void * small_free_routine(void * arg) {
+    const size_t idx = (size_t)arg;
+
+    for (size_t i = 0; i < cnt_small; i++)
+        cache_free(&mysmallcache_alloc, small_ptrs[idx][i]);
+
+    return NULL;
+}
+extern "C" void * kmalloc_routine(void * arg) {
+    const size_t idx = (size_t)arg;
+    const size_t cnt_mall = 300;
+
+    void * arr_ptrs[cnt_mall];
+    size_t arr_sizes[cnt_mall];
+
+    // sizes up to 70000, so size classes and pages are used
+    for (size_t i = 0; i < cnt_mall; i++) {
+        arr_sizes[i] = (i * 7919 + idx * 104729) % 70000 + 1;
+        arr_ptrs[i] = slab_malloc(arr_sizes[i]);
+        assert(arr_ptrs[i] != nullptr);
+        memset(arr_ptrs[i], (int)(i % 251), arr_sizes[i]);
+    }
+
+    for (size_t i = 0; i < cnt_mall; i++) {
+        for (size_t j = 0; j < arr_sizes[i]; j++)
+            assert(((uint8_t *)arr_ptrs[i])[j] == i % 251);
+        slab_free(arr_ptrs[i]);
+    }
+
+    return NULL;
+}
+// Objects are freed by other threads, after shrink all
+// magazines (per-CPU slots) come back and all slabs are released
+static void small_cache_test(int flags) {
+    pthread_t pool_small_th[cnt_small_th];
+
+    cache_setup(&mysmallcache_alloc, small_object_size, 10, flags);
+
+    for (size_t i = 0; i < cnt_small_th; i++)
+        pthread_create(&pool_small_th[i], NULL, &small_alloc_routine, (void *)i);
+    for (size_t i = 0; i < cnt_small_th; i++)
+        pthread_join(pool_small_th[i], NULL);
+
+    for (size_t i = 0; i < cnt_small_th; i++)
+        pthread_create(&pool_small_th[i], NULL, &small_free_routine, (void *)i);
+    for (size_t i = 0; i < cnt_small_th; i++)
+        pthread_join(pool_small_th[i], NULL);
+
+    cache_shrink(&mysmallcache_alloc);
+    if (mysmallcache_alloc.percpu_slots == nullptr || percpu_can_drain) {
+        assert(mysmallcache_alloc.free_list_slabs == nullptr);
+        assert(slab_partbusy_first(&mysmallcache_alloc) == nullptr);
+        assert(mysmallcache_alloc.busy_list_slabs == nullptr);
+    }
+    cache_release(&mysmallcache_alloc);
+}
+// Every round a thread allocates into one of its halves and frees
+// the other half of its neighbour, while the next round of others
+// drains these frees: lock-free pushes race with locked drains
+static const size_t cnt_exchange_rounds = 50;
+static void * exchange_ptrs[cnt_small_th][2][cnt_small / 2];
+static pthread_barrier_t exchange_barrier;
+
+extern "C" void * exchange_routine(void * arg) {
+    const size_t idx = (size_t)arg;
+    const size_t neighbour = (idx + 1) % cnt_small_th;
+
+    for (size_t r = 0; r < cnt_exchange_rounds; r++) {
+        void ** own = exchange_ptrs[idx][r % 2];
+        void ** other = exchange_ptrs[neighbour][r % 2];
+
+        for (size_t i = 0; i < cnt_small / 2; i++) {
+            own[i] = cache_alloc(&mysmallcache_alloc);
+            assert(own[i] != nullptr);
+            memset(own[i], (int)idx + 1, small_object_size);
+        }
+        pthread_barrier_wait(&exchange_barrier);
+
+        for (size_t i = 0; i < cnt_small / 2; i++) {
+            assert(((uint8_t *)other[i])[0] == neighbour + 1);
+            cache_free(&mysmallcache_alloc, other[i]);
+        }
+    }
+
+    return NULL;
+}
+// Objects are allocated and freed by different threads at once
+static void exchange_cache_test(int flags) {
+    pthread_t pool_small_th[cnt_small_th];
+
+    cache_setup(&mysmallcache_alloc, small_object_size, 0, flags);
+    pthread_barrier_init(&exchange_barrier, NULL, cnt_small_th);
+
+    for (size_t i = 0; i < cnt_small_th; i++)
+        pthread_create(&pool_small_th[i], NULL, &exchange_routine, (void *)i);
+    for (size_t i = 0; i < cnt_small_th; i++)
+        pthread_join(pool_small_th[i], NULL);
+
+    pthread_barrier_destroy(&exchange_barrier);
+    cache_shrink(&mysmallcache_alloc);
+    assert(mysmallcache_alloc.free_list_slabs == nullptr);
+    assert(slab_partbusy_first(&mysmallcache_alloc) == nullptr);
+    assert(mysmallcache_alloc.busy_list_slabs == nullptr);
+    cache_release(&mysmallcache_alloc);
+}
+// Frees objects of mysmallcache_alloc, which main thread allocated
+extern "C" void * remote_free_routine(void * arg) {
+    void ** ptrs = (void **)arg;
+
+    for (size_t i = 0; i < cnt_small; i++)
+        cache_free(&mysmallcache_alloc, ptrs[i]);
+    return NULL;
+}
+// Object of cache with ctor/dtor: magic is set once by ctor,
+// state must survive free/alloc cycle
+struct ctor_object {
+    size_t magic;
+    size_t state;
+};
+static const size_t ctor_magic = 0xC0FFEE;
+static size_t cnt_ctor_calls = 0;
+static size_t cnt_dtor_calls = 0;
+static void ctor_object_init(void * ptr) {
+    ((ctor_object *)ptr)->magic = ctor_magic;
+    ((ctor_object *)ptr)->state = 0;
+    cnt_ctor_calls++;
+}
+static void ctor_object_fini(void * ptr) {
+    assert(((ctor_object *)ptr)->magic == ctor_magic);
+    ((ctor_object *)ptr)->magic = 0;
+    cnt_dtor_calls++;
+}
+// Object of slab_cache<T>: constructed by create with args
+struct typed_object {
+    static size_t cnt_alive;
+    size_t key;
+    double value;
+
+    typed_object(size_t key, double value) : key(key), value(value) { cnt_alive++; }
+    ~typed_object() { cnt_alive--; }
+};
+size_t typed_object::cnt_alive = 0;
+
+
+
+/***********************
+ *      Benchmark      *
+ *                     *
+ ***********************/
+
+static const int max_bench_threads = 16;
+static const size_t bench_object_size = 64;
+static const size_t bench_iterations = 2000000;
+static const size_t bench_batch = 64;
+
+struct bench_arg {
+    struct cache * cache;
+};
+
+extern "C" void * bench_routine(void * arg) {
+    struct cache * cache = ((bench_arg *)arg)->cache;
+    void * ptrs[bench_batch];
+
+    for (size_t i = 0; i < bench_iterations / bench_batch; i++) {
+        for (size_t j = 0; j < bench_batch; j++)
+            ptrs[j] = cache_alloc(cache);
+        for (size_t j = 0; j < bench_batch; j++)
+            cache_free(cache, ptrs[j]);
+    }
+
+    return NULL;
+}
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Runs cnt_th threads, each allocates and frees bench_iterations
+// objects. If distinct, every thread works with its own cache,
+// otherwise all threads share one cache, created with flags.
+// Returns throughput in millions of alloc+free pairs per second
+static double bench_run(int cnt_th, bool distinct, int flags = 0) {
+    pthread_t pool_th[max_bench_threads];
+    bench_arg args[max_bench_threads];
+    static struct cache caches[max_bench_threads];
+
+    for (int i = 0; i < cnt_th; i++) {
+        if (distinct || i == 0)
+            cache_setup(&caches[i], bench_object_size, 0, flags);
+        args[i].cache = distinct ? &caches[i] : &caches[0];
+    }
+
+    double start = bench_now();
+    for (int i = 0; i < cnt_th; i++)
+        pthread_create(&pool_th[i], NULL, &bench_routine, &args[i]);
+    for (int i = 0; i < cnt_th; i++)
+        pthread_join(pool_th[i], NULL);
+    double elapsed = bench_now() - start;
+
+    for (int i = 0; i < cnt_th; i++)
+        if (distinct || i == 0)
+            cache_release(&caches[i]);
+
+    return cnt_th * bench_iterations / elapsed / 1e6;
+}
+
+static int bench() {
+    int cnt_cpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int max_th = cnt_cpu < max_bench_threads ? cnt_cpu : max_bench_threads;
+
+    printf("cpus=%d object_size=%zu iterations=%zu\n",
+           cnt_cpu, bench_object_size, bench_iterations);
+    printf("threads\tdistinct caches (Mops/s)\tshared cache (Mops/s)"
+           "\tshared per-CPU cache (Mops/s)\tshared lock-free free (Mops/s)"
+           "\tshared thread heaps (Mops/s)\n");
+
+    for (int cnt_th = 1; cnt_th <= max_th; cnt_th *= 2) {
+        double distinct = bench_run(cnt_th, true);
+        double shared = bench_run(cnt_th, false);
+        double percpu = bench_run(cnt_th, false, CACHE_PERCPU);
+        double lockfree = bench_run(cnt_th, false, CACHE_LOCKFREE_FREE);
+        double heaps = bench_run(cnt_th, false, CACHE_THREAD_HEAPS);
+        printf("%d\t%.2f\t\t\t\t%.2f\t\t\t%.2f\t\t\t\t%.2f\t\t\t\t%.2f\n",
+               cnt_th, distinct, shared, percpu, lockfree, heaps);
+    }
+
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+        return bench();
+
     // test on race condition
     const int cnt_th = 10;
     pthread_t pool_th[cnt_th];
@@ -470,8 +3405,240 @@ int main() {
 
     cache_release(&mycache_alloc);
 
+    // test of magazines and per-CPU slots
+    small_cache_test(0);
+    small_cache_test(CACHE_NO_MAGAZINES);
+    small_cache_test(CACHE_PERCPU);
+    small_cache_test(CACHE_LOCKFREE_FREE);
+    small_cache_test(CACHE_THREAD_HEAPS);
+    exchange_cache_test(CACHE_LOCKFREE_FREE);
+    exchange_cache_test(CACHE_THREAD_HEAPS);
+
+    // test of thread heaps: slabs are owned by heap of the thread,
+    // when it becomes empty, all but HEAP_EMPTY_SLABS slabs migrate
+    // back into cache
+    const size_t cnt_heap_objects = 2000;
+    static void * heap_ptrs[cnt_heap_objects];
+
+    cache_setup(&mysmallcache_alloc, small_object_size, 0, CACHE_THREAD_HEAPS);
+    for (size_t i = 0; i < cnt_heap_objects; i++)
+        heap_ptrs[i] = cache_alloc(&mysmallcache_alloc);
+    assert(mysmallcache_alloc.free_list_slabs == nullptr);
+    assert(slab_partbusy_first(&mysmallcache_alloc) == nullptr);
+
+    thread_heap * heap = tls_heaps[mysmallcache_alloc.tls_slot].heap;
+    assert(heap != nullptr && heap->cnt_used == cnt_heap_objects);
+    for (size_t i = 0; i < cnt_heap_objects; i++)
+        cache_free(&mysmallcache_alloc, heap_ptrs[i]);
+    assert(heap->cnt_used == 0);
+    assert(heap->cnt_capacity <= HEAP_EMPTY_SLABS * mysmallcache_alloc.cnt_objects);
+    assert(mysmallcache_alloc.free_list_slabs != nullptr);
+    (void) heap;
+
+    cache_shrink(&mysmallcache_alloc);
+    assert(mysmallcache_alloc.free_list_slabs == nullptr);
+    assert(slab_partbusy_first(&mysmallcache_alloc) == nullptr);
+    cache_release(&mysmallcache_alloc);
+
+    // test of lock-free free: object is pushed into its slab
+    // without lock and comes back by the next alloc
+    cache_setup(&mysmallcache_alloc, small_object_size, 0, CACHE_LOCKFREE_FREE);
+    void * lockfree_ptr = cache_alloc(&mysmallcache_alloc);
+    cache_free(&mysmallcache_alloc, lockfree_ptr);
+    assert(mysmallcache_alloc.pending_slabs != nullptr);
+    assert(mysmallcache_alloc.pending_slabs->head == nullptr);
+    assert(cache_alloc(&mysmallcache_alloc) == lockfree_ptr);
+    assert(mysmallcache_alloc.pending_slabs == nullptr);
+    cache_free(&mysmallcache_alloc, lockfree_ptr);
+    cache_shrink(&mysmallcache_alloc);
+    assert(mysmallcache_alloc.free_list_slabs == nullptr);
+    assert(slab_partbusy_first(&mysmallcache_alloc) == nullptr);
+    cache_release(&mysmallcache_alloc);
+
+    // test of headerless objects: they are packed without gaps
+    // and keep natural alignment
+    cache_setup(&mysmallcache_alloc, 16, 0, CACHE_NO_MAGAZINES);
+    uint8_t * obj1 = (uint8_t *)cache_alloc(&mysmallcache_alloc);
+    uint8_t * obj2 = (uint8_t *)cache_alloc(&mysmallcache_alloc);
+    assert(obj2 - obj1 == 16 && (size_t)obj1 % 16 == 0);
+    cache_free(&mysmallcache_alloc, obj1);
+    cache_free(&mysmallcache_alloc, obj2);
+    cache_release(&mysmallcache_alloc);
+
+    // test of remote frees: while the cache is locked, frees of
+    // other thread do not wait, next alloc returns objects into slabs
+    static void * remote_ptrs[cnt_small];
+    pthread_t remote_th;
+
+    cache_setup(&mysmallcache_alloc, small_object_size, 0, CACHE_NO_MAGAZINES);
+    for (size_t i = 0; i < cnt_small; i++)
+        remote_ptrs[i] = cache_alloc(&mysmallcache_alloc);
+
+    pthread_mutex_lock(&mysmallcache_alloc.mtx);
+    pthread_create(&remote_th, NULL, &remote_free_routine, (void *)remote_ptrs);
+    pthread_join(remote_th, NULL);
+    assert(mysmallcache_alloc.remote_free != nullptr);
+    pthread_mutex_unlock(&mysmallcache_alloc.mtx);
+
+    void * remote_ptr = cache_alloc(&mysmallcache_alloc);
+    assert(mysmallcache_alloc.remote_free == nullptr);
+    cache_free(&mysmallcache_alloc, remote_ptr);
+    cache_shrink(&mysmallcache_alloc);
+    assert(slab_partbusy_first(&mysmallcache_alloc) == nullptr);
+    assert(mysmallcache_alloc.busy_list_slabs == nullptr);
+    cache_release(&mysmallcache_alloc);
+
+    // test of object caching: ctor is called once per object,
+    // freed objects keep their state, dtor is called on release
+    const size_t cnt_ctor_objects = 1000;
+    static void * ctor_ptrs[cnt_ctor_objects];
+
+    cache_setup(&mysmallcache_alloc, sizeof(ctor_object), 0, CACHE_NO_MAGAZINES,
+                ctor_object_init, ctor_object_fini);
+    ctor_object * ctor_obj = (ctor_object *)cache_alloc(&mysmallcache_alloc);
+    assert(ctor_obj->magic == ctor_magic && cnt_ctor_calls == 1);
+    ctor_obj->state = 42;
+    cache_free(&mysmallcache_alloc, ctor_obj);
+    assert(cache_alloc(&mysmallcache_alloc) == ctor_obj);
+    assert(ctor_obj->magic == ctor_magic && ctor_obj->state == 42);
+    assert(cnt_ctor_calls == 1);
+    cache_free(&mysmallcache_alloc, ctor_obj);
+
+    assert(cache_alloc_bulk(&mysmallcache_alloc, cnt_ctor_objects, ctor_ptrs) == cnt_ctor_objects);
+    for (size_t i = 0; i < cnt_ctor_objects; i++)
+        assert(((ctor_object *)ctor_ptrs[i])->magic == ctor_magic);
+    cache_free_bulk(&mysmallcache_alloc, cnt_ctor_objects, ctor_ptrs);
+    cache_shrink(&mysmallcache_alloc);
+    assert(cnt_dtor_calls == cnt_ctor_calls);
+    cache_release(&mysmallcache_alloc);
+
+    // test of typed front-end: geometry is folded at compile time
+    // and equal to one of cache_setup
+    {
+        slab_cache<typed_object, 0> typed_cache(CACHE_NO_MAGAZINES);
+        static_assert(slab_cache<typed_object, 0>::object_size == 16, "");
+        static_assert(slab_cache<typed_object, 0>::cnt_objects == (PAGE_SIZE - META_BLOCK_SIZE) / 16, "");
+
+        typed_object * typed_obj = typed_cache.create(7, 0.5);
+        assert(typed_obj->key == 7 && typed_obj->value == 0.5);
+        assert(typed_object::cnt_alive == 1);
+        typed_cache.destroy(typed_obj);
+        assert(typed_object::cnt_alive == 0);
+        assert(typed_cache.create(8, 1.5) == typed_obj);
+        typed_cache.destroy(typed_obj);
+
+        typed_cache.shrink();
+        assert(typed_cache.raw()->free_list_slabs == nullptr);
+    }
+
+    // test of typed front-end over thread heaps: destroy must come
+    // back through the heap, that owns slab
+    {
+        const size_t cnt_typed_objects = 1000;
+        static typed_object * typed_ptrs[cnt_typed_objects];
+        slab_cache<typed_object, 0> typed_cache(CACHE_THREAD_HEAPS);
+
+        for (size_t i = 0; i < cnt_typed_objects; i++)
+            typed_ptrs[i] = typed_cache.create(i, 0.0);
+        thread_heap * heap = tls_heaps[typed_cache.raw()->tls_slot].heap;
+        assert(heap != nullptr && heap->cnt_used == cnt_typed_objects);
+        for (size_t i = 0; i < cnt_typed_objects; i++)
+            typed_cache.destroy(typed_ptrs[i]);
+        assert(heap->cnt_used == 0 && typed_object::cnt_alive == 0);
+        (void) heap;
+
+        typed_object * typed_obj = typed_cache.create(9, 2.5);
+        assert(typed_obj != nullptr && typed_obj->key == 9);
+        typed_cache.destroy(typed_obj);
+
+        typed_cache.shrink();
+        assert(typed_cache.raw()->free_list_slabs == nullptr);
+        assert(slab_partbusy_first(typed_cache.raw()) == nullptr);
+    }
+
+    // test of partial bins: allocation prefers the fullest slab,
+    // so nearly empty slab drains and is released by shrink
+    cache_setup(&mysmallcache_alloc, small_object_size, 0, CACHE_NO_MAGAZINES);
+    const size_t cnt_bin_objects = mysmallcache_alloc.cnt_objects;
+    static void * bin_ptrs[2][PAGE_SIZE / 8];
+
+    for (size_t i = 0; i < 2; i++)
+        assert(cache_alloc_bulk(&mysmallcache_alloc, cnt_bin_objects, bin_ptrs[i]) == cnt_bin_objects);
+    meta_block * fuller_slab = slab_meta_of(&mysmallcache_alloc, bin_ptrs[0][0]);
+    meta_block * emptier_slab = slab_meta_of(&mysmallcache_alloc, bin_ptrs[1][0]);
+    assert(fuller_slab != emptier_slab);
+    (void) fuller_slab; (void) emptier_slab;
+
+    // one free object in the first slab, only one used in the second
+    cache_free(&mysmallcache_alloc, bin_ptrs[0][0]);
+    for (size_t i = 1; i < cnt_bin_objects; i++)
+        cache_free(&mysmallcache_alloc, bin_ptrs[1][i]);
+    assert(emptier_slab->bin > fuller_slab->bin);
+    assert(slab_partbusy_first(&mysmallcache_alloc) == fuller_slab);
+
+    bin_ptrs[0][0] = cache_alloc(&mysmallcache_alloc);
+    assert(slab_meta_of(&mysmallcache_alloc, bin_ptrs[0][0]) == fuller_slab);
+    cache_free(&mysmallcache_alloc, bin_ptrs[1][0]);
+    cache_shrink(&mysmallcache_alloc);
+    assert(slab_partbusy_first(&mysmallcache_alloc) == nullptr);
+    assert(mysmallcache_alloc.busy_list_slabs == fuller_slab);
+    cache_free_bulk(&mysmallcache_alloc, cnt_bin_objects, bin_ptrs[0]);
+    cache_release(&mysmallcache_alloc);
+
+    // test of map of slabs: one object per slab, so
+    // thousands of slabs are added and removed
+    const size_t cnt_page_objects = 5000;
+    static void * page_ptrs[cnt_page_objects];
+
+    cache_setup(&mysmallcache_alloc, 3000, 0, CACHE_NO_MAGAZINES);
+    for (size_t i = 0; i < cnt_page_objects; i++) {
+        page_ptrs[i] = cache_alloc(&mysmallcache_alloc);
+        assert(page_ptrs[i] != nullptr);
+    }
+    for (size_t i = 0; i < cnt_page_objects; i += 2)
+        cache_free(&mysmallcache_alloc, page_ptrs[i]);
+    cache_shrink(&mysmallcache_alloc);
+    for (size_t i = 1; i < cnt_page_objects; i += 2)
+        cache_free(&mysmallcache_alloc, page_ptrs[i]);
+    cache_release(&mysmallcache_alloc);
+
+    // test of large objects: every object has own pages,
+    // a few freed ones are kept for reuse, slab_kfree
+    // comes them back into the cache too
+    const size_t cnt_large = 10;
+    void * large_ptrs[cnt_large];
+
+    cnt_ctor_calls = cnt_dtor_calls = 0;
+    cache_setup(&mycache_alloc, 1 << 20, 10, 0, ctor_object_init, ctor_object_fini);
+    assert(mycache_alloc.object_size == (1 << 20) && mycache_alloc.large_order == 8);
+    cache_release(&mycache_alloc);
+
+    cache_setup(&mycache_alloc, 300 * (1 << 10), 10, 0, ctor_object_init, ctor_object_fini);
+    assert(mycache_alloc.large_order == 7 && mycache_alloc.free_list_slabs == nullptr);
+    for (size_t i = 0; i < cnt_large; i++) {
+        large_ptrs[i] = cache_alloc(&mycache_alloc);
+        assert(large_ptrs[i] != nullptr && (size_t)large_ptrs[i] % (PAGE_SIZE << 7) == 0);
+        memset((uint8_t *)large_ptrs[i] + sizeof(ctor_object), 0xAB,
+               mycache_alloc.object_size - sizeof(ctor_object));
+    }
+    assert(cnt_ctor_calls == cnt_large);
+    cache_free_bulk(&mycache_alloc, cnt_large, large_ptrs);
+    assert(mycache_alloc.cnt_large_stash == LARGE_STASH_MAX);
+    assert(cnt_dtor_calls == cnt_large - LARGE_STASH_MAX);
+    assert(cache_alloc_bulk(&mycache_alloc, cnt_large, large_ptrs) == cnt_large);
+    assert(mycache_alloc.cnt_large_stash == 0);
+    for (size_t i = 0; i < cnt_large; i++)
+        slab_kfree(large_ptrs[i]);
+    assert(mycache_alloc.cnt_large_stash == LARGE_STASH_MAX);
+    assert(cnt_dtor_calls == cnt_ctor_calls - LARGE_STASH_MAX);
+    cache_free(&mycache_alloc, cache_alloc(&mycache_alloc));
+    cache_shrink(&mycache_alloc);
+    assert(mycache_alloc.cnt_large_stash == 0);
+    assert(cnt_dtor_calls == cnt_ctor_calls);
+    cache_release(&mycache_alloc);
+
     // how use 'dump_slab' and 'dump_cache' for debug
-    cache_setup(&mycache_alloc, object_size);
+    cache_setup(&mycache_alloc, dump_object_size, 0, CACHE_NO_MAGAZINES);
 
     dump_cache(&mycache_alloc);
 
@@ -480,7 +3647,7 @@ int main() {
     printf("\n");
 
     printf("Partially busy slab state:\n");
-        dump_slab(mycache_alloc.partbusy_list_slabs);
+        dump_slab(slab_partbusy_first(&mycache_alloc));
     printf("\n");
 
     void * ptr1 = cache_alloc(&mycache_alloc);
@@ -491,7 +3658,7 @@ int main() {
     printf("\n");
 
     printf("Partially busy slab state:\n");
-        dump_slab(mycache_alloc.partbusy_list_slabs);
+        dump_slab(slab_partbusy_first(&mycache_alloc));
     printf("\n");
 
     cache_free(&mycache_alloc, ptr1);
@@ -502,9 +3669,181 @@ int main() {
     printf("\n");
 
     printf("Partially busy slab state:\n");
-        dump_slab(mycache_alloc.partbusy_list_slabs);
+        dump_slab(slab_partbusy_first(&mycache_alloc));
     printf("\n");
 
     cache_release(&mycache_alloc);
+
+    // test of bulk allocation: objects are distinct and
+    // may be freed one by one (half of them)
+    const size_t cnt_bulk = 1000;
+    static void * bulk_ptrs[cnt_bulk];
+
+    cache_setup(&mysmallcache_alloc, small_object_size, 0);
+    size_t cnt_allocated = cache_alloc_bulk(&mysmallcache_alloc, cnt_bulk, bulk_ptrs);
+    assert(cnt_allocated == cnt_bulk);
+    (void) cnt_allocated;
+
+    for (size_t i = 0; i < cnt_bulk; i++)
+        memset(bulk_ptrs[i], (int)(i % 251), small_object_size);
+    for (size_t i = 0; i < cnt_bulk; i++) {
+        for (size_t j = 0; j < small_object_size; j++)
+            assert(((uint8_t *)bulk_ptrs[i])[j] == i % 251);
+        if (i % 2 == 0)
+            cache_free(&mysmallcache_alloc, bulk_ptrs[i]);
+    }
+
+    // test of bulk free: the rest objects of different slabs
+    size_t cnt_rest = 0;
+    for (size_t i = 1; i < cnt_bulk; i += 2)
+        bulk_ptrs[cnt_rest++] = bulk_ptrs[i];
+    cache_free_bulk(&mysmallcache_alloc, cnt_rest, bulk_ptrs);
+    cache_shrink(&mysmallcache_alloc);
+    assert(slab_partbusy_first(&mysmallcache_alloc) == nullptr);
+    assert(mysmallcache_alloc.busy_list_slabs == nullptr);
+    cache_release(&mysmallcache_alloc);
+
+    // test of bulk free: objects of 8 slabs are interleaved
+    // (A B C ... H A B ...), every slab becomes free at once
+    cache_setup(&mysmallcache_alloc, small_object_size, 0, CACHE_NO_MAGAZINES);
+    const size_t cnt_slab_objects = mysmallcache_alloc.cnt_objects;
+    const size_t cnt_mixed = 8 * cnt_slab_objects;
+    assert(cnt_mixed <= cnt_bulk);
+    assert(cache_alloc_bulk(&mysmallcache_alloc, cnt_mixed, bulk_ptrs) == cnt_mixed);
+
+    static void * mixed_ptrs[cnt_bulk];
+    for (size_t i = 0; i < cnt_mixed; i++)
+        mixed_ptrs[i] = bulk_ptrs[(i % 8) * cnt_slab_objects + i / 8];
+    cache_free_bulk(&mysmallcache_alloc, cnt_mixed, mixed_ptrs);
+    for (size_t i = 0; i < cnt_mixed; i++)
+        assert(mixed_ptrs[i] == nullptr);
+    assert(slab_partbusy_first(&mysmallcache_alloc) == nullptr);
+    assert(mysmallcache_alloc.busy_list_slabs == nullptr);
+
+    size_t cnt_free_slabs = 0;
+    for (meta_block * meta = mysmallcache_alloc.free_list_slabs; meta != nullptr; meta = meta->next) {
+        assert(meta->cnt_objects == cnt_slab_objects);
+        cnt_free_slabs++;
+    }
+    assert(cnt_free_slabs == 8);
+    (void) cnt_slab_objects; (void) cnt_free_slabs;
+    cache_release(&mysmallcache_alloc);
+
+    // test of slab_kfree: objects of caches with different
+    // slab orders are freed by pointer only
+    static struct cache kfree_caches[3];
+    const size_t kfree_sizes[3] = {24, 200, 5000};
+    const int kfree_orders[3] = {0, 3, 10};
+    const size_t cnt_kfree = 300;
+    static void * kfree_ptrs[cnt_kfree];
+
+    for (int i = 0; i < 3; i++)
+        cache_setup(&kfree_caches[i], kfree_sizes[i], kfree_orders[i]);
+    for (size_t i = 0; i < cnt_kfree; i++) {
+        kfree_ptrs[i] = cache_alloc(&kfree_caches[i % 3]);
+        assert(kfree_ptrs[i] != nullptr);
+    }
+    for (size_t i = 0; i < cnt_kfree; i++)
+        slab_kfree(kfree_ptrs[(i * 7) % cnt_kfree]);
+    for (int i = 0; i < 3; i++) {
+        cache_shrink(&kfree_caches[i]);
+        assert(slab_partbusy_first(&kfree_caches[i]) == nullptr);
+        assert(kfree_caches[i].busy_list_slabs == nullptr);
+        cache_release(&kfree_caches[i]);
+    }
+
+    // test of slab_malloc/slab_free
+    pthread_t pool_kmalloc_th[cnt_small_th];
+
+    for (size_t i = 0; i < cnt_small_th; i++)
+        pthread_create(&pool_kmalloc_th[i], NULL, &kmalloc_routine, (void *)i);
+    for (size_t i = 0; i < cnt_small_th; i++)
+        pthread_join(pool_kmalloc_th[i], NULL);
+
+    // size classes have own slots of thread tables, so alternating
+    // classes never flush magazines of each other
+    for (int i = 0; i < KMALLOC_CNT_CLASSES; i++)
+        for (int j = i + 1; j < KMALLOC_CNT_CLASSES; j++)
+            assert(kmalloc_caches[i].tls_slot != kmalloc_caches[j].tls_slot);
+
+    // test of std::pmr adapter: containers and aligned requests
+    {
+        std::pmr::memory_resource * resource = slab_resource();
+        std::pmr::vector<int> pmr_vector(resource);
+        std::pmr::map<int, int> pmr_map(resource);
+
+        for (int i = 0; i < 10000; i++) {
+            pmr_vector.push_back(i);
+            pmr_map[i] = i * 2;
+        }
+        assert(pmr_vector[9999] == 9999 && pmr_map[5000] == 10000);
+
+        const size_t alignments[] = {8, 64, 4096, 65536};
+        for (size_t alignment : alignments) {
+            void * ptr = resource->allocate(100, alignment);
+            assert((size_t)ptr % alignment == 0);
+            resource->deallocate(ptr, 100, alignment);
+        }
+        slab_memory_resource other;
+        assert(resource->is_equal(other));
+    }
+
+    // test of node allocator: nodes of map, list and unordered_map
+    // come from node caches, buckets - from the general path
+    {
+        std::map<int, int, std::less<int>, slab_node_allocator<std::pair<const int, int>>> node_map;
+        std::list<int, slab_node_allocator<int>> node_list;
+        std::unordered_map<int, int, std::hash<int>, std::equal_to<int>,
+                           slab_node_allocator<std::pair<const int, int>>> node_hash;
+
+        for (int i = 0; i < 10000; i++) {
+            node_map[i] = i;
+            node_list.push_back(i);
+            node_hash[i] = i;
+        }
+        for (int i = 0; i < 10000; i += 2) {
+            node_map.erase(i);
+            node_hash.erase(i);
+        }
+        assert(node_map.size() == 5000 && node_hash.size() == 5000);
+        assert(node_map[9999] == 9999 && node_hash[9999] == 9999 && node_list.back() == 9999);
+    }
+
+#ifdef SLAB_OPERATOR_NEW
+    // test of operator new/delete: all sizes and alignments
+    // come from slabs and pages, sized delete selects the class
+    {
+        struct alignas(256) aligned_object { uint8_t data[300]; };
+
+        int * new_int = new int(5);
+        int * new_array = new int[10000];
+        aligned_object * new_aligned = new aligned_object;
+        assert(buddy_arena_of(new_int) != nullptr && buddy_arena_of(new_array) != nullptr);
+        assert((size_t)new_aligned % 256 == 0);
+        double * new_doubles = new double[3];
+        assert((size_t)new_doubles % 16 == 0);
+
+        delete new_int;
+        delete[] new_doubles;
+        delete[] new_array;
+        delete new_aligned;
+    }
+#endif
+
+    // test of buddy allocator: when all caches are released,
+    // all slabs of different orders are merged back into arenas
+    for (int i = 0; i < KMALLOC_CNT_CLASSES; i++)
+        cache_shrink(&kmalloc_caches[i]);
+    slab_node_shrink();
+    cache_shrink(&magazine_cache);
+    cache_shrink(&heap_cache);
+#ifndef SLAB_OPERATOR_NEW
+    // (operator new keeps objects of libstdc++ in caches till exit)
+    bool is_empty = buddy_is_empty();
+    assert(is_empty);
+    (void) is_empty;
+#endif
     return 0;
 }
+
+#endif // SLAB_PRELOAD